@@ -0,0 +1,547 @@
+/*
+ * Throughput and latency benchmark of the VBUS ring.
+ *
+ * It runs the ring code of the driver(rtloader/vbus/vbus_ring.h) in user
+ * space: the producers and the consumer are pthreads pinned to different
+ * cores, sharing a ring in plain memory. No RT-Thread or QEMU is needed.
+ *
+ * With -q the consumer hands the packets to a receive queue per channel with
+ * the locking of rt_vbus_data_push/pop, and a reader thread per channel takes
+ * them out, so the latency is measured at the reader. -g puts all the queues
+ * under one lock, like the driver did before the per-channel locks.
+ *
+ * Usage: vbench [-l layout] [-r ring KB,...] [-s pkt size,...]
+ *               [-n msgs] [-p producers] [-c channels] [-q [-g]]
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+static void relax(void);
+#define rt_vbus_cpu_relax() relax()
+
+#include "vbus_ring.h"
+
+#define handle_error(msg, err) \
+    do { perror(msg); exit(err); } while (0)
+
+#define MAX_PRODUCERS 64
+#define MAX_LIST      16
+#define MAX_PKT_SZ    RT_VBUS_V3_MAX_PKT_SZ
+/* Water marks of the receive queues, in packets. */
+#define RXQ_HIGH_MARK 256
+#define RXQ_LOW_MARK  64
+
+/* Put at the start of every packet. */
+struct msg_hdr {
+    uint64_t ts;
+    uint32_t seq;
+    uint16_t producer;
+    uint16_t chn;
+};
+
+struct rxq_node {
+    struct rxq_node *next;
+    size_t size;
+    unsigned char data[];
+};
+
+/* struct rt_vbus_rxq of the driver. */
+struct rxq {
+    struct rxq_node *head, *tail;
+    pthread_spinlock_t lock;
+    /* Level of the receive water mark, under lock. */
+    unsigned int level;
+    int suspended;
+    /* Serializes the SUSPEND/RESUME, which would be posted to chn0. */
+    pthread_mutex_t wm_lock;
+    unsigned long wm_cmds;
+    unsigned long expect;
+} __attribute__((aligned(RT_VBUS_CACHE_LINE_SZ)));
+
+struct bench {
+    int layout;
+    size_t ring_sz;
+    size_t pkt_sz;
+    unsigned long nr;
+    int producers;
+    int channels;
+    int queued;
+    int global_lock;
+
+    void *mem;
+    struct rt_vbus_ring_ctx ring;
+    rt_vbus_atomic_t rsv;
+
+    volatile int go;
+    uint64_t *lat;
+    unsigned long lat_nr;
+    unsigned long errors;
+    uint64_t start_ns, end_ns;
+
+    /* Indexed by the channel, 0 is not used. */
+    struct rxq rxqs[RT_VBUS_CHANNEL_NR];
+    /* The one lock of -g. */
+    pthread_mutex_t glock;
+};
+
+struct producer_arg {
+    struct bench *b;
+    int id;
+};
+
+static int ncpu;
+static int yield_on_spin;
+
+/* Don't burn the time slice of the thread we are waiting for if there are
+ * not enough cpus. */
+static void relax(void)
+{
+    if (yield_on_spin)
+        sched_yield();
+    else
+        __asm__ __volatile__("" : : : "memory");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin_to(int cpu)
+{
+    cpu_set_t set;
+
+    if (ncpu < 2)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *producer(void *p)
+{
+    struct producer_arg *arg = p;
+    struct bench *b = arg->b;
+    unsigned char buf[MAX_PKT_SZ] __attribute__((aligned(8)));
+    struct msg_hdr *hdr = (struct msg_hdr*)buf;
+    int dnr = rt_vbus_ring_pkt_nr(&b->ring, b->pkt_sz);
+
+    pin_to(arg->id + 1);
+
+    while (!b->go)
+        rt_vbus_cpu_relax();
+
+    for (unsigned long seq = 0; seq < b->nr; seq++) {
+        unsigned int start, end;
+
+        hdr->seq      = seq;
+        hdr->producer = arg->id;
+        hdr->chn      = 1 + seq % b->channels;
+        memset(buf + sizeof(*hdr), seq & 0xFF, b->pkt_sz - sizeof(*hdr));
+
+        while (rt_vbus_ring_reserve(&b->ring, &b->rsv, dnr, &start))
+            rt_vbus_cpu_relax();
+
+        hdr->ts = now_ns();
+        end = rt_vbus_ring_put_pkt(&b->ring, start, hdr->chn, 0,
+                                   buf, b->pkt_sz);
+        rt_vbus_ring_commit(&b->ring, start, end);
+    }
+
+    return NULL;
+}
+
+static void rxq_lock(struct bench *b, struct rxq *q)
+{
+    if (b->global_lock)
+        pthread_mutex_lock(&b->glock);
+    else
+        pthread_spin_lock(&q->lock);
+}
+
+static void rxq_unlock(struct bench *b, struct rxq *q)
+{
+    if (b->global_lock)
+        pthread_mutex_unlock(&b->glock);
+    else
+        pthread_spin_unlock(&q->lock);
+}
+
+/* _chn_recv_wm_notify: re-read the state under wm_lock and send the command
+ * if it changed. */
+static void rxq_wm_notify(struct bench *b, struct rxq *q)
+{
+    int suspend;
+
+    pthread_mutex_lock(&q->wm_lock);
+    rxq_lock(b, q);
+    suspend = q->level > RXQ_HIGH_MARK;
+    rxq_unlock(b, q);
+    if (suspend != q->suspended) {
+        q->suspended = suspend;
+        q->wm_cmds++;
+    }
+    pthread_mutex_unlock(&q->wm_lock);
+}
+
+/* rt_vbus_data_push */
+static void rxq_push(struct bench *b, struct rxq *q, struct rxq_node *n)
+{
+    int warn;
+
+    n->next = NULL;
+    rxq_lock(b, q);
+    warn = ++q->level == RXQ_HIGH_MARK + 1;
+    if (q->head == NULL)
+        q->head = n;
+    else
+        q->tail->next = n;
+    q->tail = n;
+    rxq_unlock(b, q);
+
+    if (warn)
+        rxq_wm_notify(b, q);
+}
+
+/* rt_vbus_data_pop */
+static struct rxq_node *rxq_pop(struct bench *b, struct rxq *q)
+{
+    struct rxq_node *n;
+    int warn = 0;
+
+    rxq_lock(b, q);
+    n = q->head;
+    if (n) {
+        q->head = n->next;
+        warn = --q->level == RXQ_LOW_MARK;
+    }
+    rxq_unlock(b, q);
+
+    if (warn)
+        rxq_wm_notify(b, q);
+    return n;
+}
+
+/* A reader of the channel, like the read(2) of a channel fd. */
+static void *reader(void *p)
+{
+    struct producer_arg *arg = p;
+    struct bench *b = arg->b;
+    struct rxq *q = &b->rxqs[arg->id];
+    long last_seq[MAX_PRODUCERS];
+
+    pin_to(b->producers + arg->id);
+
+    for (int i = 0; i < MAX_PRODUCERS; i++)
+        last_seq[i] = -1;
+
+    for (unsigned long got = 0; got < q->expect; ) {
+        struct rxq_node *n = rxq_pop(b, q);
+        struct msg_hdr *hdr;
+        unsigned long idx;
+
+        if (!n) {
+            rt_vbus_cpu_relax();
+            continue;
+        }
+        got++;
+
+        hdr = (struct msg_hdr*)n->data;
+        idx = __atomic_fetch_add(&b->lat_nr, 1, __ATOMIC_RELAXED);
+        b->lat[idx] = now_ns() - hdr->ts;
+
+        /* The order is only kept per producer. */
+        if (n->size != b->pkt_sz || hdr->chn != arg->id ||
+            hdr->producer >= b->producers ||
+            (long)hdr->seq <= last_seq[hdr->producer] ||
+            (n->size > sizeof(*hdr) &&
+             n->data[n->size - 1] != (hdr->seq & 0xFF)))
+            __atomic_fetch_add(&b->errors, 1, __ATOMIC_RELAXED);
+        else
+            last_seq[hdr->producer] = hdr->seq;
+        free(n);
+    }
+
+    return NULL;
+}
+
+/* The drain loop of _vbus_isr. */
+static void *consumer(void *p)
+{
+    struct bench *b = p;
+    struct rt_vbus_ring_ctx *rg = &b->ring;
+    unsigned long total = b->nr * b->producers;
+    unsigned long next_seq[MAX_PRODUCERS] = {0};
+    unsigned char buf[MAX_PKT_SZ] __attribute__((aligned(8)));
+    struct msg_hdr *hdr = (struct msg_hdr*)buf;
+
+    pin_to(0);
+
+    b->start_ns = now_ns();
+    b->go = 1;
+
+    for (unsigned long got = 0; got < total; ) {
+        unsigned int get, id, tailsz;
+        size_t size;
+        void *data;
+
+        if (!rt_vbus_ring_has_data(rg)) {
+            rt_vbus_cpu_relax();
+            continue;
+        }
+
+        get  = *rg->get_idx;
+        data = rt_vbus_ring_pkt(rg, get, &id, &size);
+        if (!data) {
+            rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+            continue;
+        }
+
+        tailsz = rt_vbus_ring_pkt_tailsz(rg, get, size);
+
+        if (b->queued) {
+            struct rxq_node *n = malloc(sizeof(*n) + size);
+
+            if (!n)
+                handle_error("malloc", 1);
+            n->size = size;
+            memcpy(n->data, data, tailsz);
+            memcpy(n->data + tailsz, &rg->blks[0], size - tailsz);
+            rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+            if (id == 0 || id >= RT_VBUS_CHANNEL_NR) {
+                __atomic_fetch_add(&b->errors, 1, __ATOMIC_RELAXED);
+                free(n);
+            } else {
+                rxq_push(b, &b->rxqs[id], n);
+            }
+            got++;
+            continue;
+        }
+
+        memcpy(buf, data, tailsz);
+        memcpy(buf + tailsz, &rg->blks[0], size - tailsz);
+
+        b->lat[got++] = now_ns() - hdr->ts;
+
+        if (size != b->pkt_sz || id != hdr->chn ||
+            hdr->producer >= b->producers ||
+            hdr->seq != next_seq[hdr->producer]++ ||
+            (size > sizeof(*hdr) && buf[size - 1] != (hdr->seq & 0xFF)))
+            b->errors++;
+
+        rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+    }
+
+    if (!b->queued)
+        b->end_ns = now_ns();
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run(struct bench *b)
+{
+    pthread_t cons, prod[MAX_PRODUCERS], rd[RT_VBUS_CHANNEL_NR];
+    struct producer_arg args[MAX_PRODUCERS], rargs[RT_VBUS_CHANNEL_NR];
+    unsigned long total = b->nr * b->producers;
+    unsigned long wm_cmds = 0;
+    size_t unit;
+    double sec, rate;
+
+    if (posix_memalign(&b->mem, RT_VBUS_CACHE_LINE_SZ, b->ring_sz))
+        handle_error("posix_memalign", 1);
+    memset(b->mem, 0, b->ring_sz);
+    if (b->layout != RT_VBUS_LAYOUT_V1)
+        rt_vbus_ring_v2_format(b->mem, b->layout);
+    rt_vbus_ring_ctx_init(&b->ring, b->mem, b->ring_sz, b->layout);
+    rt_vbus_ring_reserve_init(&b->ring, &b->rsv);
+
+    b->lat = malloc(total * sizeof(*b->lat));
+    if (!b->lat)
+        handle_error("malloc", 1);
+    b->go = 0;
+    b->errors = 0;
+    b->lat_nr = 0;
+
+    if (b->queued) {
+        pthread_mutex_init(&b->glock, NULL);
+        for (int c = 1; c <= b->channels; c++) {
+            struct rxq *q = &b->rxqs[c];
+            /* Sequences of each producer that go to the channel. */
+            unsigned long per = b->nr > (unsigned long)(c - 1) ?
+                                (b->nr - c + b->channels) / b->channels : 0;
+
+            memset(q, 0, sizeof(*q));
+            pthread_spin_init(&q->lock, PTHREAD_PROCESS_PRIVATE);
+            pthread_mutex_init(&q->wm_lock, NULL);
+            q->expect = per * b->producers;
+
+            rargs[c].b  = b;
+            rargs[c].id = c;
+            if (pthread_create(&rd[c], NULL, reader, &rargs[c]))
+                handle_error("pthread_create", 1);
+        }
+    }
+
+    for (int i = 0; i < b->producers; i++) {
+        args[i].b  = b;
+        args[i].id = i;
+        if (pthread_create(&prod[i], NULL, producer, &args[i]))
+            handle_error("pthread_create", 1);
+    }
+    if (pthread_create(&cons, NULL, consumer, b))
+        handle_error("pthread_create", 1);
+
+    for (int i = 0; i < b->producers; i++)
+        pthread_join(prod[i], NULL);
+    pthread_join(cons, NULL);
+
+    if (b->queued) {
+        for (int c = 1; c <= b->channels; c++) {
+            pthread_join(rd[c], NULL);
+            wm_cmds += b->rxqs[c].wm_cmds;
+            pthread_spin_destroy(&b->rxqs[c].lock);
+            pthread_mutex_destroy(&b->rxqs[c].wm_lock);
+        }
+        pthread_mutex_destroy(&b->glock);
+        b->end_ns = now_ns();
+    }
+
+    qsort(b->lat, total, sizeof(*b->lat), cmp_u64);
+
+    sec  = (b->end_ns - b->start_ns) / 1e9;
+    rate = total / sec;
+    unit = b->layout == RT_VBUS_LAYOUT_V3 ? RT_VBUS_REC_SZ
+                                          : sizeof(struct rt_vbus_blk);
+    /* ring% is the payload in the ring space taken by a packet. wm is the
+     * SUSPEND/RESUME commands of the receive queues. */
+    printf("%6d %8zu %5zu %4d %4d %3s %5.1f %12.0f %8.1f %9llu %9llu %9llu %6lu %6lu\n",
+           b->layout, b->ring_sz / 1024, b->pkt_sz,
+           b->producers, b->channels,
+           !b->queued ? "-" : b->global_lock ? "glb" : "chn",
+           100.0 * b->pkt_sz / (rt_vbus_ring_pkt_nr(&b->ring, b->pkt_sz) * unit),
+           rate, rate * b->pkt_sz / (1024 * 1024),
+           (unsigned long long)b->lat[total / 2],
+           (unsigned long long)b->lat[total * 99 / 100],
+           (unsigned long long)b->lat[total * 999 / 1000],
+           b->errors, wm_cmds);
+
+    free(b->lat);
+    free(b->mem);
+}
+
+static int parse_list(char *s, unsigned long *v)
+{
+    int n = 0;
+
+    for (char *tok = strtok(s, ","); tok && n < MAX_LIST;
+         tok = strtok(NULL, ","))
+        v[n++] = strtoul(tok, NULL, 0);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long rings[MAX_LIST] = {64, 2048};
+    unsigned long sizes[MAX_LIST] = {16, 60, 124, RT_VBUS_MAX_PKT_SZ};
+    int ring_nr = 2, size_nr = 4;
+    static struct bench b;
+    int opt, threads;
+
+    memset(&b, 0, sizeof(b));
+    b.layout    = RT_VBUS_LAYOUT_V1;
+    b.nr        = 1000000;
+    b.producers = 1;
+    b.channels  = 1;
+
+    while ((opt = getopt(argc, argv, "l:r:s:n:p:c:qg")) != -1) {
+        switch (opt) {
+        case 'l':
+            b.layout = atoi(optarg);
+            break;
+        case 'r':
+            ring_nr = parse_list(optarg, rings);
+            break;
+        case 's':
+            size_nr = parse_list(optarg, sizes);
+            break;
+        case 'n':
+            b.nr = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            b.producers = atoi(optarg);
+            break;
+        case 'c':
+            b.channels = atoi(optarg);
+            break;
+        case 'q':
+            b.queued = 1;
+            break;
+        case 'g':
+            b.global_lock = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l layout] [-r ring KB,...] "
+                    "[-s pkt size,...] [-n msgs] [-p producers] "
+                    "[-c channels] [-q [-g]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (b.layout < RT_VBUS_LAYOUT_V1 || b.layout > RT_VBUS_LAYOUT_V3 ||
+        b.producers < 1 || b.producers > MAX_PRODUCERS ||
+        b.channels < 1 || b.channels >= RT_VBUS_CHANNEL_NR ||
+        b.nr == 0) {
+        fprintf(stderr, "invalid layout, producers, channels or msgs\n");
+        return 1;
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = b.producers + 1 + (b.queued ? b.channels : 0);
+    if (threads > ncpu) {
+        fprintf(stderr, "warning: %d threads on %d cpus, the latency "
+                "includes the scheduling\n", threads, ncpu);
+        yield_on_spin = 1;
+    }
+
+    printf("layout ring(KB)  size prod  chn rxq ring%%       msgs/s     MB/s   "
+           "p50(ns)   p99(ns)  p999(ns) errors     wm\n");
+    for (int i = 0; i < ring_nr; i++) {
+        for (int j = 0; j < size_nr; j++) {
+            size_t max_pkt = b.layout == RT_VBUS_LAYOUT_V3 ?
+                             RT_VBUS_V3_MAX_PKT_SZ : RT_VBUS_MAX_PKT_SZ;
+
+            b.ring_sz = rings[i] * 1024;
+            b.pkt_sz  = sizes[j];
+            /* A packet should fit in half of the ring. */
+            if (b.ring_sz < 4 * (b.pkt_sz + sizeof(struct rt_vbus_blk)) ||
+                b.pkt_sz < sizeof(struct msg_hdr) ||
+                b.pkt_sz > max_pkt) {
+                fprintf(stderr, "skip ring %lu KB, size %lu\n",
+                        rings[i], sizes[j]);
+                continue;
+            }
+            run(&b);
+        }
+    }
+
+    return 0;
+}
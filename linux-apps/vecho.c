@@ -38,6 +38,9 @@ int main(int argc, char *argv[])
     req.recv_wm.high = 1000;
     req.post_wm.low  = 500;
     req.post_wm.high = 1000;
+    req.rx_pool_nr   = 0;
+    req.queue        = 0;
+    req.flags        = 0;
 
     int rwfd = ioctl(ctlfd, VBUS_IOCREQ, &req);
     if (rwfd < 0)
@@ -108,7 +108,7 @@ int _do_load_fw(const char* filename,
 	return 0;
 }
 
-static void __iomem *out_ring;
+static void __iomem *qbase[RT_VBUS_QUEUE_NR];
 
 static int __init rtloader_init(void)
 {
@@ -128,7 +128,7 @@ static int __init rtloader_init(void)
 	if (_do_load_fw("/root/rtthread.bin",
 			(unsigned long)va,
 			RT_MEM_SIZE) == 0) {
-		int res;
+		int i, res;
 
 		/* We have to down the CPU before loading the code because cpu_down
 		 * will flush the cache. It will corrupt the code we just loaded some
@@ -143,8 +143,9 @@ static int __init rtloader_init(void)
 		res = _do_startup(0x6FB00000);
 		pr_info("startup return %d\n", res);
 
-		out_ring = (void*)__phys_to_virt(_RT_VBUS_RING_BASE);
-		res = driver_load(out_ring, out_ring + _RT_VBUS_RING_SZ);
+		for (i = 0; i < RT_VBUS_QUEUE_NR; i++)
+			qbase[i] = (void*)__phys_to_virt(_RT_VBUS_QUEUE_BASE(i));
+		res = driver_load(qbase, (void*)__phys_to_virt(_RT_VBUS_BULK_BASE));
 		pr_info("driver_load return %d\n", res);
 	}
 
@@ -34,25 +34,123 @@
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
 #include <linux/export.h>
+#include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/hashtable.h>
+#include <linux/poll.h>
 
 #include <vbus_api.h>
+#include <vbus_layout.h>
 
 #include "linux_driver.h"
 #include "prio_queue.h"
+#include "vbus_rxmap.h"
+#include "vbus_ring.h"
+#include "vbus_bulk.h"
+#include "vbus_pool.h"
+#include "vbus_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "vbus_trace.h"
+
+/* Packets looked at by one _vbus_rx_urgent. */
+#define _RX_SCAN_MAX    256
+
+/* A pair of rings with its own IPIs, post worker and poller, so a busy
+ * channel on one queue does not hold up the channels on the others. Queue 0
+ * carries chn0. */
+struct rt_vbus_queue {
+	unsigned int nr;
+	struct rt_vbus_ring_ctx out_ring;
+	struct rt_vbus_ring_ctx in_ring;
+
+	/* Reserve word of the IN_RING, see rt_vbus_ring_reserve. It runs ahead
+	 * of put_idx, which is only moved when the blocks are committed. The
+	 * IN_RING is shared by all the CPUs without lock. */
+	atomic64_t in_reserve;
+	/* Number of pkgs in the prio queue or being posted by the worker. */
+	atomic_t in_pending;
+	struct rt_prio_queue *prio_que;
+	struct workqueue_struct *in_wkq;
+	struct work_struct in_wk;
+	/* Posters waiting for room in the IN_RING. */
+	wait_queue_head_t post_wait;
+
+	/* Notifications delayed by the coalescing. */
+	atomic_t notify_pending;
+	struct hrtimer notify_timer;
+
+	/* The OUT_RING is drained by this thread, see _vbus_poll. */
+	struct task_struct *rx_task;
+	/* Set when the poller should run again. */
+	atomic_t rx_sched;
+	/* Set when the drain stopped on a packet it could not get a buffer
+	 * for. */
+	atomic_t rx_stalled;
+	/* First IPI not seen by the poller yet, for the latency histograms. */
+	atomic64_t rx_ipi_ts;
+	/* Held by the poller while it is draining. */
+	struct mutex rx_drain_lock;
+	/* Packets in the OUT_RING already taken by _vbus_rx_urgent, by their
+	 * first block. V3 has the most blocks. */
+	DECLARE_BITMAP(rx_taken, RT_VBUS_V3_UNIT_NR);
+};
+
+#if RT_VBUS_QUEUE_NR < 1 || RT_VBUS_QUEUE_NR > 4
+#error "RT_VBUS_QUEUE_NR should be in [1, 4]"
+#endif
+
+static struct rt_vbus_queue _queues[RT_VBUS_QUEUE_NR];
+/* Queues in use, RT_VBUS_QUEUE_NR once RT_VBUS_F_MQ is negotiated. */
+static unsigned int _queue_nr = 1;
 
-static struct rt_vbus_ring *OUT_RING;
-static struct rt_vbus_ring *IN_RING;
+/* State of the layout negotiation. */
+enum {
+	_LAYOUT_IDLE,
+	_LAYOUT_REQUESTED,
+	_LAYOUT_ACKED,
+};
+static atomic_t _layout_st = ATOMIC_INIT(_LAYOUT_IDLE);
+static DECLARE_COMPLETION(_layout_cmp);
+/* Layout to switch the OUT_RING to, set by the ACK of the request. */
+static int _out_layout_pending;
 
-/* 4 bytes for the head */
-#define LEN2BNR(len)    ((len + RT_VBUS_BLK_HEAD_SZ \
-			  + sizeof(struct rt_vbus_blk) - 1) \
-			 / sizeof(struct rt_vbus_blk))
+/* Layout of the rings proposed to the other side on loading. The peers in
+ * the tree don't answer the request, so don't ask by default. */
+static int ring_layout = RT_VBUS_LAYOUT_V1;
+module_param(ring_layout, int, 0444);
+MODULE_PARM_DESC(ring_layout, "ring layout version to negotiate, 2 for the cache-line-aligned one, 3 for the byte ring");
 
 static char* dump_cmd_pkt(unsigned char *dp, size_t dsize);
 
 static unsigned int _irq_offset;
 
+/* The channel id is a byte in the ring. */
+#if RT_VBUS_CHANNEL_NR > 256
+#error "RT_VBUS_CHANNEL_NR should not be more than 256"
+#endif
+
 static enum rt_vbus_chn_status _chn_status[RT_VBUS_CHANNEL_NR];
+/* A set bit means the channel is not AVAILABLE. Kept by _chn_set_status. */
+static DECLARE_BITMAP(_chn_used, RT_VBUS_CHANNEL_NR);
+/* Queue of each channel, set when the channel is established. */
+static unsigned char _chn_queue[RT_VBUS_CHANNEL_NR];
+
+static inline struct rt_vbus_queue* _chn_q(unsigned char chnr)
+{
+	return &_queues[_chn_queue[chnr]];
+}
+
+static void _chn_set_status(unsigned char chnr, enum rt_vbus_chn_status st)
+{
+	_chn_status[chnr] = st;
+	if (st == RT_VBUS_CHN_ST_AVAILABLE)
+		clear_bit(chnr, _chn_used);
+	else
+		set_bit(chnr, _chn_used);
+}
 
 static inline int _chn_connected(unsigned char chnr)
 {
@@ -60,11 +158,92 @@ static inline int _chn_connected(unsigned char chnr)
            _chn_status[chnr] == RT_VBUS_CHN_ST_SUSPEND;
 }
 
-/* {head, tail} */
-#define _DT_HEAD 0
-#define _DT_TAIL 1
-static struct rt_vbus_data *_bus_data[RT_VBUS_CHANNEL_NR][2];
-static DEFINE_MUTEX(_bus_data_lock);
+/* Receive queue of a channel. There is only one producer(the ISR) and one
+ * consumer(the reader) on each queue so a spin lock per channel is enough.
+ * Readers on different channels never contend with each other. */
+struct rt_vbus_rxq {
+	struct rt_vbus_data *head, *tail;
+	/* Fragments of the message being received by a datagram channel.
+	 * They are put on the queue once the last one comes. */
+	struct rt_vbus_data *part, *part_tail;
+	int dgram;
+	/* Not NULL if the channel receive into the mmaped area. */
+	struct rt_vbus_rxmap *rxmap;
+	/* Buffers of the packets. */
+	struct rt_vbus_pool *pool;
+	spinlock_t lock;
+	/* Serialize the SUSPEND/RESUME commands of the channel. */
+	struct mutex wm_lock;
+} ____cacheline_aligned_in_smp;
+
+static struct rt_vbus_rxq _chn_rxq[RT_VBUS_CHANNEL_NR];
+
+static unsigned int rx_budget = 64;
+module_param(rx_budget, uint, 0644);
+MODULE_PARM_DESC(rx_budget, "packets drained before the poller gives up the cpu");
+
+static unsigned int busy_poll_us;
+module_param(busy_poll_us, uint, 0644);
+MODULE_PARM_DESC(busy_poll_us, "microseconds to spin for the next packet before enabling the notification again");
+
+/* Packets posted with a priority below it skip the backlog of the other
+ * channels, see _vbus_rx_urgent. */
+static unsigned int rx_urgent_prio;
+module_param(rx_urgent_prio, uint, 0644);
+MODULE_PARM_DESC(rx_urgent_prio, "receive the packets with a lower qos ahead of the backlog, 0 to disable");
+
+static void _rx_schedule(struct rt_vbus_queue *q)
+{
+	/* The irq may come before the poller is started. It will see the
+	 * flag once it runs. */
+	if (!atomic_xchg(&q->rx_sched, 1) && q->rx_task)
+		wake_up_process(q->rx_task);
+}
+
+/* The batch is copied into the ring with the preemption disabled while the
+ * other producers spin on the reserve. */
+static unsigned int post_batch_max = 4096;
+module_param(post_batch_max, uint, 0644);
+MODULE_PARM_DESC(post_batch_max, "bytes of a batch put into the ring with one reservation");
+
+static unsigned int rx_pool_nr = 8;
+module_param(rx_pool_nr, uint, 0644);
+MODULE_PARM_DESC(rx_pool_nr, "receive buffers pre-allocated per size class of a channel if the request does not tell");
+
+/* Buffer for a packet of the channel. Return NULL if there is no memory, the
+ * packet should be left in the ring then. */
+static struct rt_vbus_data* _rx_alloc(unsigned int id, size_t size)
+{
+	struct rt_vbus_data *dat;
+	struct rt_vbus_pool *pool = _chn_rxq[id].pool;
+
+	if (pool) {
+		dat = rt_vbus_pool_get(pool, size);
+	} else {
+		dat = kmalloc(size + sizeof(*dat), GFP_KERNEL | __GFP_NOWARN);
+		if (!dat)
+			return NULL;
+		dat->size = size;
+		dat->next = NULL;
+		dat->bulk = NULL;
+		dat->pool = NULL;
+	}
+	if (dat) {
+		dat->more = 0;
+		dat->ts   = rt_vbus_lat_stamp();
+	}
+	return dat;
+}
+
+/* Attach the pool to the newly established channel. */
+static void _rx_set_pool(unsigned int id, struct rt_vbus_pool *pool,
+			 int dgram)
+{
+	spin_lock(&_chn_rxq[id].lock);
+	_chn_rxq[id].pool  = pool;
+	_chn_rxq[id].dgram = dgram;
+	spin_unlock(&_chn_rxq[id].lock);
+}
 
 #ifdef RT_VBUS_USING_FLOW_CONTROL
 #include "watermark_queue.h"
@@ -111,99 +290,237 @@ EXPORT_SYMBOL(rt_vbus_set_post_wm);
 #endif
 
 
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+/* Raise the receive water level of the channel. Should be called with the
+ * lock of the rxq held. Return non-zero if the other side should be warned by
+ * _chn_recv_wm_notify. */
+static int _chn_recv_wm_inc(unsigned int id)
+{
+	_chn_recv_wm[id].level++;
+	if (_chn_recv_wm[id].level == 0)
+		_chn_recv_wm[id].level = -1;
+	if (_chn_recv_wm[id].level > _chn_recv_wm[id].high_mark &&
+	    _chn_recv_wm[id].level > _chn_recv_wm[id].last_warn) {
+		/* Warn the other side in 100 more pkgs. */
+		_chn_recv_wm[id].last_warn = _chn_recv_wm[id].level + 100;
+		return 1;
+	}
+	return 0;
+}
+
+/* Lower the receive water level of the channel. Should be called with the
+ * lock of the rxq held. Return non-zero if the other side should be resumed
+ * by _chn_recv_wm_notify. */
+static int _chn_recv_wm_dec(unsigned int id)
+{
+	if (_chn_recv_wm[id].level != 0) {
+		_chn_recv_wm[id].level--;
+		if (_chn_recv_wm[id].level == _chn_recv_wm[id].low_mark &&
+		    _chn_recv_wm[id].last_warn > _chn_recv_wm[id].low_mark) {
+			_chn_recv_wm[id].last_warn = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Send SUSPEND or RESUME to the other side. It could not be done with the
+ * spin lock held because rt_vbus_post may sleep. The state is read again
+ * under the wm_lock so the last command sent always matches the latest state
+ * even if the ISR and the reader race with each other. */
+static void _chn_recv_wm_notify(unsigned int id)
+{
+	unsigned char buf[2];
+
+	mutex_lock(&_chn_rxq[id].wm_lock);
+	buf[0] = _chn_recv_wm[id].last_warn ? RT_VBUS_CHN0_CMD_SUSPEND
+					    : RT_VBUS_CHN0_CMD_RESUME;
+	buf[1] = id;
+	trace_vbus_flow(id, buf[0] == RT_VBUS_CHN0_CMD_SUSPEND, 0);
+	rt_vbus_post(0, 0, buf, sizeof(buf));
+	rt_vbus_stat_inc(id, buf[0] == RT_VBUS_CHN0_CMD_SUSPEND ?
+			 RT_VBUS_STAT_SUSPEND_TX : RT_VBUS_STAT_RESUME_TX);
+	mutex_unlock(&_chn_rxq[id].wm_lock);
+}
+#else
+static inline int _chn_recv_wm_inc(unsigned int id) { return 0; }
+static inline int _chn_recv_wm_dec(unsigned int id) { return 0; }
+static inline void _chn_recv_wm_notify(unsigned int id) {}
+#endif
+
 /** Push a data packet into the queue.
  *
- * The data packet should be allocated by kmalloc.
+ * The data packet should be allocated by _rx_alloc, from the pool of the
+ * channel or by kmalloc. It is freed by rt_vbus_data_free.
  */
 static int rt_vbus_data_push(unsigned int id, struct rt_vbus_data *dat)
 {
-	int res;
+	int warn;
+	struct rt_vbus_rxq *q;
+	struct rt_vbus_data *first = dat;
 
 	BUG_ON(!(0 < id && id < RT_VBUS_CHANNEL_NR));
 
-	/* TODO: on mutex per channel. */
-	res = mutex_lock_interruptible(&_bus_data_lock);
-	if (res)
-		return res;
+	q = &_chn_rxq[id];
 
-	if (_bus_data[id][_DT_HEAD] == NULL) {
-		_bus_data[id][_DT_HEAD] = dat;
-		_bus_data[id][_DT_TAIL] = dat;
-	} else {
-		_bus_data[id][_DT_TAIL]->next = dat;
-		_bus_data[id][_DT_TAIL] = dat;
-	}
+	spin_lock(&q->lock);
+	warn = _chn_recv_wm_inc(id);
 
-#ifdef RT_VBUS_USING_FLOW_CONTROL
-	_chn_recv_wm[id].level++;
-	if (_chn_recv_wm[id].level == 0)
-		_chn_recv_wm[id].level = -1;
-	if (_chn_recv_wm[id].level > _chn_recv_wm[id].high_mark &&
-	    _chn_recv_wm[id].level > _chn_recv_wm[id].last_warn) {
-		unsigned char buf[2] = {RT_VBUS_CHN0_CMD_SUSPEND, id};
-		//pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
-		rt_vbus_post(0, 0, buf, sizeof(buf));
-		/* Warn the other side in 100 more pkgs. */
-		_chn_recv_wm[id].last_warn = _chn_recv_wm[id].level + 100;
+	if (q->dgram && (dat->more || q->part)) {
+		if (q->part == NULL)
+			q->part = dat;
+		else
+			q->part_tail->next = dat;
+		q->part_tail = dat;
+
+		if (dat->more) {
+			spin_unlock(&q->lock);
+			goto _out;
+		}
+		first   = q->part;
+		q->part = NULL;
 	}
-#endif
-	mutex_unlock(&_bus_data_lock);
+
+	if (q->head == NULL)
+		q->head = first;
+	else
+		q->tail->next = first;
+	q->tail = dat;
+	spin_unlock(&q->lock);
+
+_out:
+	if (warn)
+		_chn_recv_wm_notify(id);
 
 	return 0;
 }
 
 /** Pop a data packet from the queue.
  *
- * The data packet should be freed by kfree.
+ * The data packet should be freed by rt_vbus_data_free.
  */
 struct rt_vbus_data* rt_vbus_data_pop(unsigned char id)
 {
-	int res;
+	int warn = 0;
 	struct rt_vbus_data *dat;
+	struct rt_vbus_rxq *q;
 
 	if (!(0 < id && id < RT_VBUS_CHANNEL_NR))
 		return ERR_PTR(-EINVAL);
 
-	res = mutex_lock_interruptible(&_bus_data_lock);
-	if (res)
-		return ERR_PTR(res);
-
-	dat = _bus_data[id][_DT_HEAD];
-	if (dat)
-		_bus_data[id][_DT_HEAD] = dat->next;
+	q = &_chn_rxq[id];
 
-#ifdef RT_VBUS_USING_FLOW_CONTROL
-	if (_chn_recv_wm[id].level != 0) {
-		_chn_recv_wm[id].level--;
-		if (_chn_recv_wm[id].level == _chn_recv_wm[id].low_mark &&
-		    _chn_recv_wm[id].last_warn > _chn_recv_wm[id].low_mark) {
-			unsigned char buf[2] = {RT_VBUS_CHN0_CMD_RESUME, id};
-			//pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
-			rt_vbus_post(0, 0, buf, sizeof(buf));
-			_chn_recv_wm[id].last_warn = 0;
-		}
+	spin_lock(&q->lock);
+	dat = q->head;
+	if (dat) {
+		q->head = dat->next;
+		warn = _chn_recv_wm_dec(id);
 	}
-#endif
-	mutex_unlock(&_bus_data_lock);
+	spin_unlock(&q->lock);
+
+	if (warn)
+		_chn_recv_wm_notify(id);
 
 	return dat;
 }
 EXPORT_SYMBOL(rt_vbus_data_pop);
 
-int rt_vbus_data_empty(unsigned char id)
+static void _bulk_give_back(void *buf, size_t len);
+
+void rt_vbus_data_free(struct rt_vbus_data *dat)
 {
-	int res;
+	int i;
+
+	if (dat->bulk)
+		_bulk_give_back(dat->bulk, dat->size);
+
+	if (!dat->pool) {
+		kfree(dat);
+		return;
+	}
+	rt_vbus_pool_put(dat);
+
+	/* There is a buffer for the stalled drains now. */
+	for (i = 0; i < ARRAY_SIZE(_queues); i++) {
+		if (atomic_xchg(&_queues[i].rx_stalled, 0))
+			_rx_schedule(&_queues[i]);
+	}
+}
+EXPORT_SYMBOL(rt_vbus_data_free);
 
+int rt_vbus_data_empty(unsigned char id)
+{
 	if (id == 0 || id >= RT_VBUS_CHANNEL_NR)
 		return 1;
 
-	mutex_lock(&_bus_data_lock);
-	res = (_bus_data[id][_DT_HEAD] == NULL);
-	mutex_unlock(&_bus_data_lock);
+	/* A single load, no need to take the lock. */
+	return ACCESS_ONCE(_chn_rxq[id].head) == NULL;
+}
+EXPORT_SYMBOL(rt_vbus_data_empty);
+
+void rt_vbus_set_rxmap(unsigned char id, struct rt_vbus_rxmap *map)
+{
+	BUG_ON(!(0 < id && id < RT_VBUS_CHANNEL_NR));
+	/* The fragments of a message would go in as separate packets. */
+	WARN_ON(map && _chn_rxq[id].dgram);
+
+	spin_lock(&_chn_rxq[id].lock);
+	_chn_rxq[id].rxmap = map;
+	spin_unlock(&_chn_rxq[id].lock);
+}
+EXPORT_SYMBOL(rt_vbus_set_rxmap);
+
+/* Put the packet into the mmaped area of the channel. Return -ENODEV if the
+ * channel is not mmaped. */
+static int _rxmap_push(unsigned int id,
+		       const void *d0, size_t l0,
+		       const void *d1, size_t l1)
+{
+	int warn = 0, res = -ENODEV;
+	struct rt_vbus_rxq *q = &_chn_rxq[id];
+
+	spin_lock(&q->lock);
+	if (q->rxmap) {
+		res = rt_vbus_rxmap_put(q->rxmap, d0, l0, d1, l1);
+		if (res == 0)
+			warn = _chn_recv_wm_inc(id);
+	}
+	spin_unlock(&q->lock);
+
+	if (warn)
+		_chn_recv_wm_notify(id);
 
 	return res;
 }
-EXPORT_SYMBOL(rt_vbus_data_empty);
+
+int rt_vbus_rxmap_done(unsigned char id, unsigned int nr)
+{
+	int res, warn = 0;
+	struct rt_vbus_rxq *q;
+
+	if (!(0 < id && id < RT_VBUS_CHANNEL_NR))
+		return -EINVAL;
+
+	q = &_chn_rxq[id];
+
+	spin_lock(&q->lock);
+	if (q->rxmap) {
+		int i;
+
+		res = rt_vbus_rxmap_consume(q->rxmap, nr);
+		for (i = 0; i < res; i++)
+			warn |= _chn_recv_wm_dec(id);
+	} else {
+		res = -EINVAL;
+	}
+	spin_unlock(&q->lock);
+
+	if (warn)
+		_chn_recv_wm_notify(id);
+
+	return res;
+}
+EXPORT_SYMBOL(rt_vbus_rxmap_done);
 
 const char *rt_vbus_chn_st2str[] = {
 	"available",
@@ -259,55 +576,124 @@ static void rt_vbus_register_callback(unsigned char chnr, rt_vbus_callback cb)
 	_vbus_callbacks[chnr] = cb;
 }
 
-static void rt_vbus_notify_host(void)
+static void rt_vbus_notify_host(struct rt_vbus_queue *q)
 {
-	rt_vmm_trigger_emuint(_irq_offset + RT_VBUS_HOST_VIRQ);
+	rt_vbus_stat_inc(0, RT_VBUS_STAT_IPI_TX);
+	rt_vmm_trigger_emuint(_irq_offset + RT_VBUS_HOST_VIRQ_Q(q->nr));
 }
 
-static void _ring_add_get_bnr(struct rt_vbus_ring *ring,
-			      size_t bnr)
+/* Features supported by this side. */
+#ifdef RT_VBUS_USING_EVENT_IDX
+#define _F_EVENT_IDX     RT_VBUS_F_EVENT_IDX
+#else
+#define _F_EVENT_IDX     0
+#endif
+#ifdef RT_VBUS_USING_BULK
+#define _F_BULK          RT_VBUS_F_BULK
+#else
+#define _F_BULK          0
+#endif
+#if RT_VBUS_QUEUE_NR > 1
+#define _F_MQ            RT_VBUS_F_MQ
+#else
+#define _F_MQ            0
+#endif
+#define _LOCAL_FEATURES  (_F_EVENT_IDX | _F_BULK | _F_MQ | RT_VBUS_F_FRAG)
+
+/* Features negotiated with the other side by RT_VBUS_CHN0_CMD_FEATURE. */
+static unsigned int _vbus_features;
+
+static inline int _has_feature(unsigned int f)
 {
-	int nidx = ring->get_idx + bnr;
+	return ACCESS_ONCE(_vbus_features) & f;
+}
 
-	if (nidx >= RT_VMM_RB_BLK_NR) {
-		nidx -= RT_VMM_RB_BLK_NR;
-	}
-	smp_wmb();
-	ring->get_idx = nidx;
+static void _vbus_set_features(unsigned int f)
+{
+	_vbus_features = f & _LOCAL_FEATURES;
+	/* The extra queues are ready once the rings of the last one are
+	 * formatted, see _vbus_queues_format. */
+	if (_has_feature(RT_VBUS_F_MQ) &&
+	    _queues[RT_VBUS_QUEUE_NR - 1].in_ring.base)
+		_queue_nr = RT_VBUS_QUEUE_NR;
+	pr_info("VMM/Bus: features %#x, %d queues\n", _vbus_features, _queue_nr);
+}
+
+/* Notification coalescing for the IN_RING. When notify_coalesce_us is not 0,
+ * the notification for new packets is delayed by up to that long, or until
+ * notify_coalesce_nr notifications are pending if that is not 0. */
+static unsigned int notify_coalesce_us;
+module_param(notify_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(notify_coalesce_us, "max delay of the notification to RT-Thread in us, 0 to disable coalescing");
+
+static unsigned int notify_coalesce_nr;
+module_param(notify_coalesce_nr, uint, 0644);
+MODULE_PARM_DESC(notify_coalesce_nr, "notify RT-Thread right away when this many notifications are pending");
+
+static enum hrtimer_restart _notify_timer_fn(struct hrtimer *timer)
+{
+	struct rt_vbus_queue *q = container_of(timer, struct rt_vbus_queue,
+					       notify_timer);
+
+	if (atomic_xchg(&q->notify_pending, 0))
+		rt_vbus_notify_host(q);
+	return HRTIMER_NORESTART;
 }
 
-static int _bus_ring_space_nr(struct rt_vbus_ring *rg)
+/* Notify the host that there is new data in the IN_RING of the queue. */
+static void _vbus_kick_host(struct rt_vbus_queue *q)
 {
-	int delta;
+	unsigned int us = ACCESS_ONCE(notify_coalesce_us);
+	unsigned int nr = ACCESS_ONCE(notify_coalesce_nr);
 
-	smp_rmb();
-	delta = rg->get_idx - rg->put_idx;
+	if (us == 0) {
+		rt_vbus_notify_host(q);
+		return;
+	}
 
-	if (delta > 0) {
-		/* Put is behind the get. */
-		return delta - 1;
-	} else {
-		/* delta is negative. */
-		return RT_VMM_RB_BLK_NR + delta - 1;
+	if (nr && atomic_inc_return(&q->notify_pending) >= nr) {
+		if (atomic_xchg(&q->notify_pending, 0))
+			rt_vbus_notify_host(q);
+		return;
+	} else if (!nr) {
+		atomic_inc(&q->notify_pending);
 	}
+
+	if (!hrtimer_active(&q->notify_timer))
+		hrtimer_start(&q->notify_timer, ns_to_ktime(us * 1000ULL),
+			      HRTIMER_MODE_REL);
 }
 
 struct rt_vbus_pkg {
 	unsigned char id;
 	unsigned char prio;
-	unsigned char len;
+	unsigned int len;
 	const void *data;
+	/* If not NULL, the pkg is a batch of nr messages posted by
+	 * rt_vbus_post_batch. data and len are not used then. */
+	const struct rt_vbus_msg *msgs;
+	unsigned int nr;
+	/* Not the last fragment of the message. */
+	int more;
 	struct completion *cmp;
+	/* If not NULL, takes the result of the post before cmp is completed. */
+	int *res;
+	/* Set by rt_vbus_post_async. The message is posted as a whole. */
+	rt_vbus_post_done done;
+	void *arg;
+	/* rt_vbus_post entry, for the latency histograms. */
+	u64 ts;
+	u32 gts;
 };
 
-static void _vbus_isr_bridge(struct work_struct *work);
-
 static void _havest_in_data(struct work_struct *work);
-static struct rt_prio_queue* _prio_que;
-static struct workqueue_struct *_ring_in_wkq;
-DECLARE_WORK(_ring_in_wk, _havest_in_data);
-static struct workqueue_struct *_ring_wkq;
-DECLARE_WORK(_ring_wk, _vbus_isr_bridge);
+
+#ifdef RT_VBUS_USING_DIRECT_POST
+static int _vbus_post_direct(struct rt_vbus_queue *q,
+			     unsigned char id, unsigned char prio,
+			     const void *data, size_t len, u32 gts);
+#endif
+static int _vbus_post_has_room(struct rt_vbus_queue *q, size_t len);
 
 int rt_vbus_post(unsigned char id, unsigned char prio,
 		 const void *data, size_t len)
@@ -315,11 +701,17 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 	int putsz = 0;
 	int res = 0;
 	struct rt_vbus_pkg pkg;
+	struct rt_vbus_queue *q;
 	const unsigned char *dp;
+	u64 ts = rt_vbus_lat_stamp();
+	u32 gts = rt_vbus_lat_gstamp();
 	DECLARE_COMPLETION_ONSTACK(cmp);
 
 	if (id >= RT_VBUS_CHANNEL_NR)
 		return -EINVAL;
+	q = _chn_q(id);
+
+	trace_vbus_post(id, prio, len);
 
 #ifdef RT_VBUS_USING_FLOW_CONTROL
 	res = wait_event_interruptible(_chn_suspended_threads[id],
@@ -331,16 +723,30 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 	if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
 		return -EINVAL;
 
+#ifdef RT_VBUS_USING_DIRECT_POST
+	/* Skip the prio queue and the worker if nobody is in front of us. */
+	if (_vbus_post_direct(q, id, prio, data, len, gts) == 0) {
+		rt_vbus_lat_account(id, RT_VBUS_LAT_POST_COMMIT, ts);
+		return 0;
+	}
+#endif
+
 	dp       = data;
 	pkg.id   = id;
 	pkg.prio = prio;
+	pkg.msgs = NULL;
+	pkg.nr   = 0;
+	pkg.res  = NULL;
+	pkg.done = NULL;
+	pkg.ts   = ts;
+	pkg.gts  = gts;
 	for (putsz = 0; len; len -= putsz) {
 		int dataend;
 
 		pkg.data = dp;
 
-		if (len > RT_VBUS_MAX_PKT_SZ) {
-			putsz = RT_VBUS_MAX_PKT_SZ;
+		if (len > q->in_ring.max_pkt) {
+			putsz = q->in_ring.max_pkt;
 			dataend = 0;
 		} else {
 			putsz = len;
@@ -355,9 +761,16 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 		} else {
 			pkg.cmp = NULL;
 		}
+		pkg.more = !dataend;
 
 #ifdef RT_VBUS_USING_FLOW_CONTROL
-		res = rt_wm_que_inc(&_chn_wm_que[id]);
+		{
+			u64 t = rt_vbus_stat_clock();
+
+			res = rt_wm_que_inc(&_chn_wm_que[id]);
+			rt_vbus_stat_add(id, RT_VBUS_STAT_WM_WAIT_NS,
+					 rt_vbus_stat_clock() - t);
+		}
 		if (res)
 			break;
 #endif
@@ -365,15 +778,14 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 		/* We need to queue the work before push data into prio_que
 		 * because rt_prio_queue_push may block and it's safe to queue
 		 * the work more than once. */
-		queue_work(_ring_in_wkq, &_ring_in_wk);
+		queue_work(q->in_wkq, &q->in_wk);
 
-		res = rt_prio_queue_push(_prio_que, prio, (char*)&pkg);
-		/*
-		 *pr_info("post chn: %d, prio: %d, data: %p, len: %lu, res: %d\n",
-		 *        id, prio, data, (unsigned long)len, res);
-		 */
-		if (res)
+		atomic_inc(&q->in_pending);
+		res = rt_prio_queue_push(q->prio_que, prio, (char*)&pkg);
+		if (res) {
+			atomic_dec(&q->in_pending);
 			break;
+		}
 
 		/* There is a chance that the work is done *before*
 		 * rt_prio_queue_push, which will result in dead lock(work done
@@ -382,7 +794,7 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 		 *
 		 * FIXME: get rid off this.
 		 */
-		queue_work(_ring_in_wkq, &_ring_in_wk);
+		queue_work(q->in_wkq, &q->in_wk);
 
 		if (dataend) {
 			/* we need to let the cmp be valid as long as possible or the workqueue
@@ -395,107 +807,430 @@ int rt_vbus_post(unsigned char id, unsigned char prio,
 }
 EXPORT_SYMBOL(rt_vbus_post);
 
-enum _vbus_session_st
+int rt_vbus_post_batch(unsigned char id, unsigned char prio,
+		       const struct rt_vbus_msg *msgs, unsigned int nr)
 {
-	SESSIOM_AVAILABLE,
-	SESSIOM_LISTENING,
-	SESSIOM_ESTABLISHING,
-};
-
-struct rt_vbus_conn_session {
-	struct {
-		unsigned char cmd;
-		char name[RT_VBUS_CHN_NAME_MAX];
-	} buf;
-	/* negative value means error */
-	int chnr;
-	enum _vbus_session_st st;
-	rt_vbus_callback cb;
-	struct completion cmp;
-	struct rt_vbus_request *req;
-};
+	int res = 0;
+	struct rt_vbus_pkg pkg;
+	struct rt_vbus_queue *q;
+	DECLARE_COMPLETION_ONSTACK(cmp);
 
-static struct rt_vbus_conn_session _sess[RT_VBUS_CHANNEL_NR/2];
-static DEFINE_MUTEX(_sess_lock);
+	if (id >= RT_VBUS_CHANNEL_NR)
+		return -EINVAL;
 
-void rt_vbus_sess_dump(void)
-{
-	int i;
+	if (nr == 0)
+		return 0;
+	q = _chn_q(id);
 
-	pr_err("vbus conn session:\n");
-	for (i = 0; i < ARRAY_SIZE(_sess); i++) {
-		pr_err("%2d(%s):%s\n", i, _sess[i].buf.name,
-		       rt_vbus_sess_st2str[_sess[i].st]);
-	}
-}
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	res = wait_event_interruptible(_chn_suspended_threads[id],
+				       _chn_status[id] != RT_VBUS_CHN_ST_SUSPEND);
+	if (res)
+		return res;
+#endif
 
-static int _sess_find(const unsigned char *name,
-		      enum _vbus_session_st st)
-{
-	int i;
+	if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
+		return -EINVAL;
 
-	for (i = 0; i < ARRAY_SIZE(_sess); i++)
-		if (_sess[i].st == st &&
-		    strncmp(_sess[i].buf.name,
-			    (char*)name,
-			    sizeof(_sess[i].buf.name)) == 0)
-			break;
-	return i;
-}
+	pkg.id   = id;
+	pkg.prio = prio;
+	pkg.len  = 0;
+	pkg.data = NULL;
+	pkg.msgs = msgs;
+	pkg.nr   = nr;
+	pkg.more = 0;
+	pkg.cmp  = &cmp;
+	pkg.res  = &res;
+	pkg.done = NULL;
+	pkg.ts   = rt_vbus_lat_stamp();
+	pkg.gts  = rt_vbus_lat_gstamp();
 
-int rt_vbus_request_chn(struct rt_vbus_request *req,
-			int is_server,
-			rt_vbus_callback cb)
-{
-	int i, res, nlen;
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	{
+		u64 t = rt_vbus_stat_clock();
 
-	res = mutex_lock_interruptible(&_sess_lock);
+		/* The whole batch is one item in the queue. */
+		res = rt_wm_que_inc(&_chn_wm_que[id]);
+		rt_vbus_stat_add(id, RT_VBUS_STAT_WM_WAIT_NS,
+				 rt_vbus_stat_clock() - t);
+	}
 	if (res)
 		return res;
+#endif
 
-	for (i = 0; i < ARRAY_SIZE(_sess); i++) {
-		if (_sess[i].st == SESSIOM_AVAILABLE)
-			break;
-	}
-	if (i == ARRAY_SIZE(_sess)) {
-		mutex_unlock(&_sess_lock);
-		return -EBUSY;
+	/* Same dance as rt_vbus_post. */
+	queue_work(q->in_wkq, &q->in_wk);
+
+	atomic_inc(&q->in_pending);
+	res = rt_prio_queue_push(q->prio_que, prio, (char*)&pkg);
+	if (res) {
+		atomic_dec(&q->in_pending);
+		return res;
 	}
 
-	strncpy(_sess[i].buf.name, req->name, sizeof(_sess[i].buf.name));
-	_sess[i].buf.name[sizeof(_sess[i].buf.name)-1] = '\0';
-	nlen = strlen(_sess[i].buf.name) + 1;
+	queue_work(q->in_wkq, &q->in_wk);
 
-	pr_info("request chn for: %s, %s server\n",
-		_sess[i].buf.name, is_server ? "is" : "not");
-	init_completion(&_sess[i].cmp);
+	/* The worker puts the result into res. */
+	wait_for_completion(&cmp);
 
-	_sess[i].cb = cb;
-	_sess[i].req = req;
+	return res;
+}
+EXPORT_SYMBOL(rt_vbus_post_batch);
 
-	if (is_server) {
-		_sess[i].st = SESSIOM_LISTENING;
-		mutex_unlock(&_sess_lock);
-		goto Wait_for_cmp;
-	}
+int rt_vbus_post_async(unsigned char id, unsigned char prio,
+		       const void *data, size_t len, int flags,
+		       rt_vbus_post_done done, void *arg)
+{
+	int res = 0;
+	struct rt_vbus_pkg pkg;
+	struct rt_vbus_queue *q;
+	int nonblock = flags & RT_VBUS_POST_NONBLOCK;
+	u64 ts = rt_vbus_lat_stamp();
+	u32 gts = rt_vbus_lat_gstamp();
 
-	_sess[i].st = SESSIOM_ESTABLISHING;
+	if (id >= RT_VBUS_CHANNEL_NR || !done)
+		return -EINVAL;
+	q = _chn_q(id);
+
+	trace_vbus_post(id, prio, len);
+
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	if (nonblock) {
+		if (_chn_status[id] == RT_VBUS_CHN_ST_SUSPEND)
+			return -EAGAIN;
+	} else {
+		res = wait_event_interruptible(_chn_suspended_threads[id],
+					       _chn_status[id] != RT_VBUS_CHN_ST_SUSPEND);
+		if (res)
+			return res;
+	}
+#endif
+
+	if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
+		return -EINVAL;
+
+#ifdef RT_VBUS_USING_DIRECT_POST
+	if (_vbus_post_direct(q, id, prio, data, len, gts) == 0) {
+		rt_vbus_lat_account(id, RT_VBUS_LAT_POST_COMMIT, ts);
+		done(arg, 0);
+		return 0;
+	}
+#endif
+
+	/* The pkgs in front of us are not counted. The worker may still wait
+	 * for them. */
+	if (nonblock && !_vbus_post_has_room(q, len))
+		return -EAGAIN;
+
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	if (nonblock) {
+		res = rt_wm_que_tryinc(&_chn_wm_que[id]);
+	} else {
+		u64 t = rt_vbus_stat_clock();
+
+		res = rt_wm_que_inc(&_chn_wm_que[id]);
+		rt_vbus_stat_add(id, RT_VBUS_STAT_WM_WAIT_NS,
+				 rt_vbus_stat_clock() - t);
+	}
+	if (res)
+		return res;
+#endif
+
+	pkg.id   = id;
+	pkg.prio = prio;
+	pkg.len  = len;
+	pkg.data = data;
+	pkg.msgs = NULL;
+	pkg.nr   = 0;
+	pkg.more = 0;
+	pkg.cmp  = NULL;
+	pkg.res  = NULL;
+	pkg.done = done;
+	pkg.arg  = arg;
+	pkg.ts   = ts;
+	pkg.gts  = gts;
+
+	/* Same dance as rt_vbus_post. */
+	queue_work(q->in_wkq, &q->in_wk);
+
+	atomic_inc(&q->in_pending);
+	if (nonblock)
+		res = rt_prio_queue_trypush(q->prio_que, prio, (char*)&pkg);
+	else
+		res = rt_prio_queue_push(q->prio_que, prio, (char*)&pkg);
+	if (res) {
+		atomic_dec(&q->in_pending);
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+		rt_wm_que_dec(&_chn_wm_que[id]);
+#endif
+		return res;
+	}
+
+	queue_work(q->in_wkq, &q->in_wk);
+
+	return 0;
+}
+EXPORT_SYMBOL(rt_vbus_post_async);
+
+unsigned int rt_vbus_post_poll(unsigned char id, struct file *filp,
+			       struct poll_table_struct *wait)
+{
+	struct rt_vbus_queue *q;
+
+	if (id >= RT_VBUS_CHANNEL_NR)
+		return POLLERR;
+	q = _chn_q(id);
+
+	poll_wait(filp, &q->post_wait, wait);
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	poll_wait(filp, &_chn_suspended_threads[id], wait);
+	poll_wait(filp, &_chn_wm_que[id].waitq, wait);
+
+	if (ACCESS_ONCE(_chn_wm_que[id].level) > _chn_wm_que[id].high_mark)
+		return 0;
+#endif
+
+	if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
+		return 0;
+
+	/* Ask for a kick if the ring is full. */
+	if (!_vbus_post_has_room(q, q->in_ring.max_pkt))
+		return 0;
+
+	return POLLOUT | POLLWRNORM;
+}
+EXPORT_SYMBOL(rt_vbus_post_poll);
+
+enum _vbus_session_st
+{
+	SESSIOM_AVAILABLE,
+	SESSIOM_LISTENING,
+	SESSIOM_ESTABLISHING,
+};
+
+struct rt_vbus_conn_session {
+	struct {
+		unsigned char cmd;
+		char name[RT_VBUS_CHN_NAME_MAX];
+	} buf;
+	/* negative value means error */
+	int chnr;
+	enum _vbus_session_st st;
+	rt_vbus_callback cb;
+	struct completion cmp;
+	struct rt_vbus_request *req;
+	/* Receive pool of the channel, handed over once it is established. */
+	struct rt_vbus_pool *pool;
+	/* In _sess_hash while it is not AVAILABLE. */
+	struct hlist_node node;
+	/* Told when an async request is settled, see _sess_settle. */
+	rt_vbus_req_done done;
+	void *arg;
+};
+
+#define _SESS_NR        (RT_VBUS_CHANNEL_NR / 2)
+
+static struct rt_vbus_conn_session _sess[_SESS_NR];
+static DEFINE_MUTEX(_sess_lock);
+/* A set bit means the session is taken. */
+static DECLARE_BITMAP(_sess_used, _SESS_NR);
+/* Listening and establishing sessions by name, looked up by chn0. */
+static DEFINE_HASHTABLE(_sess_hash, 6);
+/* Protects _sess_hash and the done callbacks of the sessions. */
+static DEFINE_SPINLOCK(_sess_hash_lock);
+/* Sessions of the async requests with an ENABLE not posted yet. */
+static DECLARE_BITMAP(_sess_enable, _SESS_NR);
+static DEFINE_MUTEX(_sess_enable_lock);
+
+void rt_vbus_sess_dump(void)
+{
+	int i;
+
+	pr_err("vbus conn session:\n");
+	for (i = 0; i < ARRAY_SIZE(_sess); i++) {
+		pr_err("%2d(%s):%s\n", i, _sess[i].buf.name,
+		       rt_vbus_sess_st2str[_sess[i].st]);
+	}
+}
+
+static u32 _sess_key(const char *name)
+{
+	return full_name_hash((const unsigned char*)name,
+			      strnlen(name, RT_VBUS_CHN_NAME_MAX));
+}
+
+/* Return the index of the session with the name in the state st, or
+ * ARRAY_SIZE(_sess) if there is none. */
+static int _sess_find(const unsigned char *name,
+		      enum _vbus_session_st st)
+{
+	int i = ARRAY_SIZE(_sess);
+	struct rt_vbus_conn_session *s;
+
+	spin_lock(&_sess_hash_lock);
+	hash_for_each_possible(_sess_hash, s, node, _sess_key((char*)name)) {
+		if (s->st == st &&
+		    strncmp(s->buf.name,
+			    (char*)name,
+			    sizeof(s->buf.name)) == 0) {
+			i = s - _sess;
+			break;
+		}
+	}
+	spin_unlock(&_sess_hash_lock);
+	return i;
+}
+
+/* Make the session i visible to chn0 in the state st. */
+static void _sess_publish(int i, enum _vbus_session_st st)
+{
+	spin_lock(&_sess_hash_lock);
+	_sess[i].st = st;
+	hash_add(_sess_hash, &_sess[i].node, _sess_key(_sess[i].buf.name));
+	spin_unlock(&_sess_hash_lock);
+}
+
+/* The request of the session i is settled with _sess[i].chnr. */
+static void _sess_settle(int i)
+{
+	spin_lock(&_sess_hash_lock);
+	complete(&_sess[i].cmp);
+	if (_sess[i].done)
+		_sess[i].done(_sess[i].arg, _sess[i].chnr);
+	spin_unlock(&_sess_hash_lock);
+}
+
+/* Stop telling the owner of the async request. */
+static void _sess_detach(int i)
+{
+	spin_lock(&_sess_hash_lock);
+	_sess[i].done = NULL;
+	spin_unlock(&_sess_hash_lock);
+}
+
+static void _sess_release(int i)
+{
+	spin_lock(&_sess_hash_lock);
+	if (_sess[i].st != SESSIOM_AVAILABLE)
+		hash_del(&_sess[i].node);
+	_sess[i].st = SESSIOM_AVAILABLE;
+	spin_unlock(&_sess_hash_lock);
+	clear_bit(i, _sess_used);
+}
+
+/* Post the ENABLEs of the async requests started so far in one batch. */
+static void _sess_enable_work(struct work_struct *work)
+{
+	static struct rt_vbus_msg msgs[_SESS_NR];
+	static int idx[_SESS_NR];
+	int i, nr = 0, res;
+
+	mutex_lock(&_sess_enable_lock);
+	for_each_set_bit(i, _sess_enable, _SESS_NR) {
+		clear_bit(i, _sess_enable);
+		msgs[nr].data = &_sess[i].buf;
+		msgs[nr].len  = strlen(_sess[i].buf.name) + 2;
+		pr_info("%s --> remote\n", dump_cmd_pkt((char*)&_sess[i].buf,
+							msgs[nr].len));
+		idx[nr++] = i;
+	}
+
+	if (nr) {
+		res = rt_vbus_post_batch(0, 0, msgs, nr);
+		/* Fail the requests whose ENABLE is not posted. */
+		for (i = res < 0 ? 0 : res; i < nr; i++) {
+			_sess[idx[i]].chnr = res < 0 ? res : -EIO;
+			_sess_settle(idx[i]);
+		}
+	}
+	mutex_unlock(&_sess_enable_lock);
+}
+static DECLARE_WORK(_sess_enable_wk, _sess_enable_work);
+
+/* Take a session for the request and send the ENABLE if we are the client.
+ * The ENABLE of an async request is left to _sess_enable_work. Return the
+ * index of the session. */
+static int _sess_start(struct rt_vbus_request *req,
+		       int is_server,
+		       rt_vbus_callback cb,
+		       rt_vbus_req_done done, void *arg)
+{
+	int i, res, nlen;
+
+	if (req->queue >= RT_VBUS_QUEUE_NR)
+		return -EINVAL;
+
+	res = mutex_lock_interruptible(&_sess_lock);
+	if (res)
+		return res;
+
+	i = find_first_zero_bit(_sess_used, ARRAY_SIZE(_sess));
+	if (i >= ARRAY_SIZE(_sess)) {
+		mutex_unlock(&_sess_lock);
+		return -EBUSY;
+	}
+	set_bit(i, _sess_used);
+
+	strncpy(_sess[i].buf.name, req->name, sizeof(_sess[i].buf.name));
+	_sess[i].buf.name[sizeof(_sess[i].buf.name)-1] = '\0';
+	nlen = strlen(_sess[i].buf.name) + 1;
+
+	pr_info("request chn for: %s, %s server\n",
+		_sess[i].buf.name, is_server ? "is" : "not");
+	init_completion(&_sess[i].cmp);
+
+	_sess[i].pool = rt_vbus_pool_create(req->rx_pool_nr ? req->rx_pool_nr
+							    : rx_pool_nr);
+	if (!_sess[i].pool) {
+		clear_bit(i, _sess_used);
+		mutex_unlock(&_sess_lock);
+		return -ENOMEM;
+	}
+
+	_sess[i].cb = cb;
+	_sess[i].req = req;
+	_sess[i].chnr = 0;
+	_sess[i].done = done;
+	_sess[i].arg = arg;
+
+	if (is_server) {
+		_sess_publish(i, SESSIOM_LISTENING);
+		mutex_unlock(&_sess_lock);
+		return i;
+	}
+
+	_sess_publish(i, SESSIOM_ESTABLISHING);
 	mutex_unlock(&_sess_lock);
 
 	_sess[i].buf.cmd = RT_VBUS_CHN0_CMD_ENABLE;
 
+	if (done) {
+		set_bit(i, _sess_enable);
+		schedule_work(&_sess_enable_wk);
+		return i;
+	}
+
 	pr_info("%s --> remote\n", dump_cmd_pkt((char*)&_sess[i].buf, nlen+1));
 	res = rt_vbus_post(0, 0, &_sess[i].buf, nlen+1);
-	if (res < 0)
+	if (res < 0) {
+		rt_vbus_pool_delete(_sess[i].pool);
+		_sess[i].pool = NULL;
+		_sess_release(i);
 		return res;
+	}
+
+	return i;
+}
 
-Wait_for_cmp:
-	res = wait_for_completion_interruptible(&_sess[i].cmp);
+/* Free the session i. res is non-zero if the request is given up before it
+ * is settled. Return the chnr or negative error. */
+static int _sess_end(int i, int res)
+{
 	if (res) {
 		/* cleanup the mass when there is a signal but we have done
 		 * some job */
-		if (_sess[i].st == SESSIOM_ESTABLISHING) {
-			_chn_status[_sess[i].chnr] = RT_VBUS_CHN_ST_AVAILABLE;
+		if (_sess[i].st == SESSIOM_ESTABLISHING && _sess[i].chnr > 0) {
+			_chn_set_status(_sess[i].chnr, RT_VBUS_CHN_ST_AVAILABLE);
 		}
 	} else {
 		res = _sess[i].chnr;
@@ -503,12 +1238,110 @@ Wait_for_cmp:
 
 	pr_info("get chnr: %d for %s\n", res, _sess[i].buf.name);
 
-	_sess[i].st = SESSIOM_AVAILABLE;
+	/* Not handed over to the channel. */
+	if (_sess[i].pool) {
+		rt_vbus_pool_delete(_sess[i].pool);
+		_sess[i].pool = NULL;
+	}
+	_sess_release(i);
 
 	return res;
 }
+
+int rt_vbus_request_chn(struct rt_vbus_request *req,
+			int is_server,
+			rt_vbus_callback cb)
+{
+	int i;
+
+	i = _sess_start(req, is_server, cb, NULL, NULL);
+	if (i < 0)
+		return i;
+
+	return _sess_end(i, wait_for_completion_interruptible(&_sess[i].cmp));
+}
 EXPORT_SYMBOL(rt_vbus_request_chn);
 
+int rt_vbus_request_chn_async(struct rt_vbus_request *req,
+			      int is_server,
+			      rt_vbus_callback cb,
+			      rt_vbus_req_done done, void *arg)
+{
+	if (!done)
+		return -EINVAL;
+
+	return _sess_start(req, is_server, cb, done, arg);
+}
+EXPORT_SYMBOL(rt_vbus_request_chn_async);
+
+static int _sess_handle_ok(int handle)
+{
+	return 0 <= handle && handle < ARRAY_SIZE(_sess) &&
+	       test_bit(handle, _sess_used);
+}
+
+int rt_vbus_request_finish(int handle)
+{
+	if (!_sess_handle_ok(handle))
+		return -EINVAL;
+
+	if (!completion_done(&_sess[handle].cmp))
+		return -EAGAIN;
+
+	_sess_detach(handle);
+	return _sess_end(handle, 0);
+}
+EXPORT_SYMBOL(rt_vbus_request_finish);
+
+void rt_vbus_request_cancel(int handle)
+{
+	int res;
+
+	if (!_sess_handle_ok(handle))
+		return;
+
+	_sess_detach(handle);
+
+	/* The ENABLE may not be posted yet. */
+	mutex_lock(&_sess_enable_lock);
+	clear_bit(handle, _sess_enable);
+	mutex_unlock(&_sess_enable_lock);
+
+	if (completion_done(&_sess[handle].cmp)) {
+		/* Established meanwhile, nobody takes it. */
+		res = _sess_end(handle, 0);
+		if (res > 0)
+			rt_vbus_close_chn(res);
+		return;
+	}
+
+	_sess_end(handle, -ECANCELED);
+}
+EXPORT_SYMBOL(rt_vbus_request_cancel);
+
+/* Detach the receive pool from the closed channel and delete it. */
+static void _rx_release_pool(unsigned char chnr)
+{
+	int i;
+	struct rt_vbus_pool *pool;
+
+	spin_lock(&_chn_rxq[chnr].lock);
+	pool = _chn_rxq[chnr].pool;
+	_chn_rxq[chnr].pool = NULL;
+	spin_unlock(&_chn_rxq[chnr].lock);
+
+	if (!pool)
+		return;
+
+	/* The drains may still be getting a buffer from it. The bulk
+	 * descriptors come on chn0 so not only the queue of the channel. */
+	for (i = 0; i < ARRAY_SIZE(_queues); i++) {
+		mutex_lock(&_queues[i].rx_drain_lock);
+		mutex_unlock(&_queues[i].rx_drain_lock);
+	}
+	rt_vbus_pool_delete(pool);
+}
+
 void rt_vbus_close_chn(unsigned char chnr)
 {
 	int err;
@@ -519,26 +1352,37 @@ void rt_vbus_close_chn(unsigned char chnr)
 
 	if (_chn_status[chnr] == RT_VBUS_CHN_ST_CLOSED ||
 	    _chn_status[chnr] == RT_VBUS_CHN_ST_CLOSING) {
-		_chn_status[chnr] = RT_VBUS_CHN_ST_AVAILABLE;
+		_chn_set_status(chnr, RT_VBUS_CHN_ST_AVAILABLE);
+		_rx_release_pool(chnr);
 		return;
 	}
 
 	if (!_chn_connected(chnr))
 		return;
 
-	_chn_status[chnr] = RT_VBUS_CHN_ST_CLOSING;
+	_chn_set_status(chnr, RT_VBUS_CHN_ST_CLOSING);
 	pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
 	err = rt_vbus_post(0, 0, &buf, sizeof(buf));
 
 	rt_vbus_register_callback(chnr, NULL);
 
-	for (dat = _bus_data[chnr][_DT_HEAD];
-	     dat; dat = ndat) {
+	spin_lock(&_chn_rxq[chnr].lock);
+	dat = _chn_rxq[chnr].head;
+	_chn_rxq[chnr].head = _chn_rxq[chnr].tail = NULL;
+	if (_chn_rxq[chnr].part) {
+		_chn_rxq[chnr].part_tail->next = dat;
+		dat = _chn_rxq[chnr].part;
+		_chn_rxq[chnr].part = NULL;
+	}
+	_chn_rxq[chnr].dgram = 0;
+	spin_unlock(&_chn_rxq[chnr].lock);
+
+	for (; dat; dat = ndat) {
 		ndat = dat->next;
-		kfree(dat);
+		rt_vbus_data_free(dat);
 	}
 
-	_bus_data[chnr][_DT_HEAD] = _bus_data[chnr][_DT_TAIL] = NULL;
+	_rx_release_pool(chnr);
 }
 EXPORT_SYMBOL(rt_vbus_close_chn);
 
@@ -556,6 +1400,17 @@ static size_t __dump_naked_cmd(char *dst, size_t lsize,
 	} else if (dp[0] == RT_VBUS_CHN0_CMD_ENABLE) {
 		len = snprintf(dst, lsize, "%s %s",
 			       rt_vbus_cmd2str[dp[0]], dp+1);
+	} else if (dp[0] == RT_VBUS_CHN0_CMD_FEATURE) {
+		len = snprintf(dst, lsize, "FEATURE %#x", dp[1]);
+	} else if (dp[0] == RT_VBUS_CHN0_CMD_LAYOUT) {
+		len = snprintf(dst, lsize, "LAYOUT %d", dp[1]);
+	} else if (dp[0] == RT_VBUS_CHN0_CMD_QUEUE) {
+		len = snprintf(dst, lsize, "QUEUE %d %d", dp[1], dp[2]);
+	} else if (dp[0] == RT_VBUS_CHN0_CMD_BULK ||
+		   dp[0] == RT_VBUS_CHN0_CMD_BULK_DONE) {
+		len = snprintf(dst, lsize, "%s %d",
+			       dp[0] == RT_VBUS_CHN0_CMD_BULK ?
+			       "BULK" : "BULK_DONE", dp[1]);
 	} else if (dp[0] < RT_VBUS_CHN0_CMD_MAX) {
 		len = snprintf(dst, lsize, "%s %s %d",
 			       rt_vbus_cmd2str[dp[0]],
@@ -619,9 +1474,165 @@ static int _chn0_ack(size_t dsize, unsigned char *dp)
 	return _chn0_echo_with(RT_VBUS_CHN0_CMD_ACK, dsize, dp);
 }
 
+/* Put the channel on the queue qnr, or queue 0 if the other side has only
+ * one. The other side is told before the channel is established so it posts
+ * on the same queue. */
+static void _chn_set_queue(unsigned char chnr, unsigned int qnr)
+{
+	unsigned char buf[3];
+
+	if (qnr >= _queue_nr)
+		qnr = 0;
+	_chn_queue[chnr] = qnr;
+	if (qnr == 0)
+		return;
+
+	buf[0] = RT_VBUS_CHN0_CMD_QUEUE;
+	buf[1] = chnr;
+	buf[2] = qnr;
+	pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
+	if (rt_vbus_post(0, 0, buf, sizeof(buf)))
+		pr_err("post chn0 QUEUE err\n");
+}
+
+static void _bulk_give_back(void *buf, size_t len)
+{
+	struct rt_vbus_bulk_desc desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.cmd = RT_VBUS_CHN0_CMD_BULK_DONE;
+	desc.off = rt_vbus_bulk_off(buf);
+	desc.len = len;
+
+	if (rt_vbus_post(0, 0, &desc, sizeof(desc)))
+		pr_err("VMM/Bus: fail to give back bulk buffer %#x\n", desc.off);
+}
+
+int rt_vbus_bulk_supported(void)
+{
+	return _has_feature(RT_VBUS_F_BULK);
+}
+EXPORT_SYMBOL(rt_vbus_bulk_supported);
+
+int rt_vbus_post_bulk(unsigned char id, unsigned char prio,
+		      void *buf, size_t len)
+{
+	int res;
+	struct rt_vbus_bulk_desc desc;
+
+	if (id == 0 || id >= RT_VBUS_CHANNEL_NR)
+		return -EINVAL;
+
+	if (!_has_feature(RT_VBUS_F_BULK))
+		return -EOPNOTSUPP;
+
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	/* The descriptor goes on chn0 but the data is for the channel. */
+	res = wait_event_interruptible(_chn_suspended_threads[id],
+				       _chn_status[id] != RT_VBUS_CHN_ST_SUSPEND);
+	if (res)
+		return res;
+#endif
+
+	if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
+		return -EINVAL;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.cmd  = RT_VBUS_CHN0_CMD_BULK;
+	desc.chnr = id;
+	desc.off  = rt_vbus_bulk_off(buf);
+	desc.len  = len;
+
+	res = rt_vbus_post(0, prio, &desc, sizeof(desc));
+	if (res == 0) {
+		rt_vbus_stat_inc(id, RT_VBUS_STAT_TX_PKTS);
+		rt_vbus_stat_add(id, RT_VBUS_STAT_TX_BYTES, len);
+	}
+	return res;
+}
+EXPORT_SYMBOL(rt_vbus_post_bulk);
+
+/* The other side lends us a buffer. Queue it to the channel without
+ * copying. */
+static void _bulk_recv(unsigned char *dp, size_t dsize)
+{
+	int err;
+	void *buf;
+	struct rt_vbus_data *dat;
+	struct rt_vbus_bulk_desc desc;
+
+	if (dsize < sizeof(desc))
+		return;
+	memcpy(&desc, dp, sizeof(desc));
+
+	buf = rt_vbus_bulk_remote(desc.off, desc.len);
+	if (!buf || desc.chnr == 0 || desc.chnr >= RT_VBUS_CHANNEL_NR) {
+		rt_vbus_stat_inc(0, RT_VBUS_STAT_DROP_INVALID);
+		pr_err("VMM/Bus: invalid bulk buffer %#x+%u on chn %d\n",
+		       desc.off, desc.len, desc.chnr);
+		return;
+	}
+
+	if (!_chn_connected(desc.chnr)) {
+		rt_vbus_stat_inc(desc.chnr, RT_VBUS_STAT_DROP_CLOSED);
+		goto _give_back;
+	}
+
+	err = _rxmap_push(desc.chnr, buf, desc.len, NULL, 0);
+	if (err == 0) {
+		rt_vbus_stat_inc(desc.chnr, RT_VBUS_STAT_RX_PKTS);
+		rt_vbus_stat_add(desc.chnr, RT_VBUS_STAT_RX_BYTES, desc.len);
+		rt_vbus_notify_chn(desc.chnr);
+		goto _give_back;
+	} else if (err != -ENODEV) {
+		pr_info("drop on rxmap full\n");
+		rt_vbus_stat_inc(desc.chnr, RT_VBUS_STAT_DROP_RXMAP);
+		goto _give_back;
+	}
+
+	dat = _rx_alloc(desc.chnr, 0);
+	if (!dat) {
+		pr_info("drop on kmalloc fail\n");
+		rt_vbus_stat_inc(desc.chnr, RT_VBUS_STAT_DROP_NOMEM);
+		goto _give_back;
+	}
+	dat->size = desc.len;
+	dat->bulk = buf;
+	rt_vbus_data_push(desc.chnr, dat);
+	rt_vbus_stat_inc(desc.chnr, RT_VBUS_STAT_RX_PKTS);
+	rt_vbus_stat_add(desc.chnr, RT_VBUS_STAT_RX_BYTES, desc.len);
+
+	rt_vbus_notify_chn(desc.chnr);
+	return;
+
+_give_back:
+	_bulk_give_back(buf, desc.len);
+}
+
+static void _bulk_done(unsigned char *dp, size_t dsize)
+{
+	void *buf;
+	struct rt_vbus_bulk_desc desc;
+
+	if (dsize < sizeof(desc))
+		return;
+	memcpy(&desc, dp, sizeof(desc));
+
+	buf = rt_vbus_bulk_local(desc.off);
+	if (!buf) {
+		pr_err("VMM/Bus: invalid bulk buffer %#x given back\n",
+		       desc.off);
+		return;
+	}
+	rt_vbus_bulk_free(buf);
+}
+
 static int _chn0_actor(unsigned char *dp, size_t dsize)
 {
-	if (*dp != RT_VBUS_CHN0_CMD_SUSPEND && *dp != RT_VBUS_CHN0_CMD_RESUME)
+	trace_vbus_chn0_cmd(dp[0], dsize > 1 ? dp[1] : 0, dsize);
+
+	if (*dp != RT_VBUS_CHN0_CMD_SUSPEND && *dp != RT_VBUS_CHN0_CMD_RESUME &&
+	    *dp != RT_VBUS_CHN0_CMD_BULK && *dp != RT_VBUS_CHN0_CMD_BULK_DONE)
 		pr_info("local <-- %s\n", dump_cmd_pkt(dp, dsize));
 
 	switch (*dp) {
@@ -636,11 +1647,8 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 			break;
 		}
 
-		for (chnr = 0; chnr < ARRAY_SIZE(_chn_status); chnr++) {
-			if (_chn_status[chnr] == RT_VBUS_CHN_ST_AVAILABLE)
-				break;
-		}
-		if (chnr == ARRAY_SIZE(_chn_status)) {
+		chnr = find_first_zero_bit(_chn_used, RT_VBUS_CHANNEL_NR);
+		if (chnr >= RT_VBUS_CHANNEL_NR) {
 			_chn0_nak(dsize, dp);
 			break;
 		}
@@ -655,6 +1663,7 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 
 		rt_vbus_set_recv_wm(chnr, _sess[i].req->recv_wm.low, _sess[i].req->recv_wm.high);
 		rt_vbus_set_post_wm(chnr, _sess[i].req->post_wm.low, _sess[i].req->post_wm.high);
+		_chn_set_queue(chnr, _sess[i].req->queue);
 
 		err = rt_vbus_post(0, 0, resp, dsize+1);
 
@@ -662,7 +1671,7 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 			pr_info("%s --> remote\n", dump_cmd_pkt(resp, dsize+1));
 			_sess[i].st   = SESSIOM_ESTABLISHING;
 			_sess[i].chnr = chnr;
-			_chn_status[chnr] = RT_VBUS_CHN_ST_ESTABLISHING;
+			_chn_set_status(chnr, RT_VBUS_CHN_ST_ESTABLISHING);
 		} else {
 			pr_err("post chn0 SET err: %d\n", err);
 		}
@@ -696,11 +1705,15 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 		rt_vbus_register_callback(chnr, _sess[i].cb);
 		rt_vbus_set_recv_wm(chnr, _sess[i].req->recv_wm.low, _sess[i].req->recv_wm.high);
 		rt_vbus_set_post_wm(chnr, _sess[i].req->post_wm.low, _sess[i].req->post_wm.high);
+		_chn_set_queue(chnr, _sess[i].req->queue);
 
 		if (_chn0_ack(dsize, dp) >= 0) {
 			_sess[i].chnr = chnr;
-			_chn_status[chnr] = RT_VBUS_CHN_ST_ESTABLISHED;
-			complete(&_sess[i].cmp);
+			_rx_set_pool(chnr, _sess[i].pool,
+				     _sess[i].req->flags & RT_VBUS_REQ_DGRAM);
+			_sess[i].pool = NULL;
+			_chn_set_status(chnr, RT_VBUS_CHN_ST_ESTABLISHED);
+			_sess_settle(i);
 		}
 	}
 		break;
@@ -717,8 +1730,18 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 			chnr = dp[1+strlen((const char*)dp+2)+2];
 
 			rt_vbus_register_callback(chnr, _sess[i].cb);
-			_chn_status[_sess[i].chnr] = RT_VBUS_CHN_ST_ESTABLISHED;
-			complete(&_sess[i].cmp);
+			_rx_set_pool(_sess[i].chnr, _sess[i].pool,
+				     _sess[i].req->flags & RT_VBUS_REQ_DGRAM);
+			_sess[i].pool = NULL;
+			_chn_set_status(_sess[i].chnr, RT_VBUS_CHN_ST_ESTABLISHED);
+			_sess_settle(i);
+		} else if (dp[1] == RT_VBUS_CHN0_CMD_LAYOUT) {
+			if (atomic_cmpxchg(&_layout_st, _LAYOUT_REQUESTED,
+					   _LAYOUT_ACKED) == _LAYOUT_REQUESTED)
+				/* Switched after this packet is consumed. */
+				_out_layout_pending = dp[2];
+		} else if (dp[1] == RT_VBUS_CHN0_CMD_FEATURE) {
+			_vbus_set_features(dp[2]);
 		} else if (dp[1] == RT_VBUS_CHN0_CMD_DISABLE) {
 			unsigned char chnr = dp[2];
 
@@ -727,7 +1750,7 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 
 			/* We could only get here by sending DISABLE command, which is
 			 * initiated by the rt_vbus_close_chn. */
-			_chn_status[chnr] = RT_VBUS_CHN_ST_AVAILABLE;
+			_chn_set_status(chnr, RT_VBUS_CHN_ST_AVAILABLE);
 
 			rt_vbus_register_callback(chnr, NULL);
 			/* notify the thread that the channel has been closed */
@@ -745,7 +1768,7 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 		if (_chn_status[chnr] != RT_VBUS_CHN_ST_ESTABLISHED)
 			break;
 
-		_chn_status[chnr] = RT_VBUS_CHN_ST_CLOSING;
+		_chn_set_status(chnr, RT_VBUS_CHN_ST_CLOSING);
 
 		_chn0_ack(dsize, dp);
 		/* notify the thread that the channel has been closed */
@@ -761,70 +1784,347 @@ static int _chn0_actor(unsigned char *dp, size_t dsize)
 				/* drop that spurious packet */
 				break;
 
-			_sess[i].chnr = -EIO;
-			complete(&_sess[i].cmp);
-		} else if (dp[1] == RT_VBUS_CHN0_CMD_SET) {
-			pr_err("NAK for %d not implemented\n", dp[1]);
-		} else {
-			pr_err("invalid NAK for %d\n", dp[1]);
-		}
-		break;
-	case RT_VBUS_CHN0_CMD_SUSPEND: {
-#ifdef RT_VBUS_USING_FLOW_CONTROL
-		unsigned char chnr = dp[1];
+			_sess[i].chnr = -EIO;
+			_sess_settle(i);
+		} else if (dp[1] == RT_VBUS_CHN0_CMD_LAYOUT) {
+			if (atomic_cmpxchg(&_layout_st, _LAYOUT_REQUESTED,
+					   _LAYOUT_IDLE) == _LAYOUT_REQUESTED)
+				complete(&_layout_cmp);
+		} else if (dp[1] == RT_VBUS_CHN0_CMD_SET) {
+			pr_err("NAK for %d not implemented\n", dp[1]);
+		} else {
+			pr_err("invalid NAK for %d\n", dp[1]);
+		}
+		break;
+	case RT_VBUS_CHN0_CMD_SUSPEND: {
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+		unsigned char chnr = dp[1];
+
+		if (chnr == 0 || chnr >= RT_VBUS_CHANNEL_NR)
+			break;
+
+		rt_vbus_stat_inc(chnr, RT_VBUS_STAT_SUSPEND_RX);
+		if (_chn_status[chnr] != RT_VBUS_CHN_ST_ESTABLISHED)
+			break;
+
+		_chn_set_status(chnr, RT_VBUS_CHN_ST_SUSPEND);
+		trace_vbus_flow(chnr, 1, 1);
+#endif
+	}
+		break;
+	case RT_VBUS_CHN0_CMD_RESUME: {
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+		unsigned char chnr = dp[1];
+
+		if (chnr == 0 || chnr >= RT_VBUS_CHANNEL_NR)
+			break;
+
+		rt_vbus_stat_inc(chnr, RT_VBUS_STAT_RESUME_RX);
+		if (_chn_status[chnr] != RT_VBUS_CHN_ST_SUSPEND)
+			break;
+
+		_chn_set_status(chnr, RT_VBUS_CHN_ST_ESTABLISHED);
+		trace_vbus_flow(chnr, 0, 1);
+
+		wake_up_interruptible_all(&_chn_suspended_threads[chnr]);
+#endif
+	}
+		break;
+	case RT_VBUS_CHN0_CMD_FEATURE: {
+		unsigned char resp[2] = {RT_VBUS_CHN0_CMD_FEATURE,
+					 dp[1] & _LOCAL_FEATURES};
+
+		_chn0_ack(sizeof(resp), resp);
+		_vbus_set_features(resp[1]);
+	}
+		break;
+	case RT_VBUS_CHN0_CMD_BULK:
+		_bulk_recv(dp, dsize);
+		break;
+	case RT_VBUS_CHN0_CMD_BULK_DONE:
+		_bulk_done(dp, dsize);
+		break;
+	default:
+		/* just ignore the invalid cmd */
+		printk("VMM/Bus: unknown cmd %d on chn0\n", *dp);
+		break;
+	};
+	return 0;
+}
+
+/* Format the OUT_RING in the new layout.
+ *
+ * We are the consumer so it is done right after the ACK, which is the last
+ * packet the other side puts in the old layout. The other side waits for the
+ * magic before posting again.
+ */
+static void _out_ring_switch(void)
+{
+	struct rt_vbus_queue *q = &_queues[0];
+	struct rt_vbus_ring_v2 *rg = q->out_ring.base;
+	int layout = _out_layout_pending;
+
+	rt_vbus_ring_v2_format(rg, layout);
+	rt_vbus_ring_ctx_init(&q->out_ring, rg, _RT_VBUS_RING_SZ, layout);
+
+	_out_layout_pending = 0;
+	complete(&_layout_cmp);
+}
+
+/* Ask the other side to use the ring_layout on queue 0. Should be called
+ * before any other packet is posted. Keep the original layout if the other
+ * side does not know it. */
+static void _vbus_layout_negotiate(void)
+{
+	unsigned char buf[2] = {RT_VBUS_CHN0_CMD_LAYOUT, ring_layout};
+	struct rt_vbus_queue *q = &_queues[0];
+	struct rt_vbus_ring_v2 *inr = q->in_ring.base;
+	unsigned long timeout;
+
+	if (ring_layout != RT_VBUS_LAYOUT_V2 &&
+	    ring_layout != RT_VBUS_LAYOUT_V3)
+		return;
+
+	/* The IN_RING is empty now. Clear the magic so we won't see a stale
+	 * one. */
+	inr->cons.layout = 0;
+	atomic_set(&_layout_st, _LAYOUT_REQUESTED);
+
+	pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
+	if (rt_vbus_post(0, 0, buf, sizeof(buf)) < 0)
+		return;
+
+	if (!wait_for_completion_timeout(&_layout_cmp, HZ) &&
+	    atomic_cmpxchg(&_layout_st, _LAYOUT_REQUESTED,
+			   _LAYOUT_IDLE) == _LAYOUT_REQUESTED) {
+		pr_info("VMM/Bus: no answer for the layout, keep v%d\n",
+			q->in_ring.layout);
+		return;
+	}
+	/* The answer came in just on time. */
+	wait_for_completion(&_layout_cmp);
+
+	if (atomic_read(&_layout_st) != _LAYOUT_ACKED)
+		return;
+
+	/* The other side formats the IN_RING once it consumed our request. */
+	timeout = jiffies + HZ;
+	while (inr->cons.layout != (RT_VBUS_LAYOUT_MAGIC | ring_layout)) {
+		if (time_after(jiffies, timeout)) {
+			pr_err("VMM/Bus: IN_RING not formatted in v%d\n",
+			       ring_layout);
+			return;
+		}
+		msleep(1);
+	}
+	smp_rmb();
+
+	rt_vbus_ring_ctx_init(&q->in_ring, inr, _RT_VBUS_RING_SZ, ring_layout);
+	rt_vbus_ring_reserve_init(&q->in_ring, &q->in_reserve);
+
+	pr_info("VMM/Bus: ring layout v%d, %d blocks\n",
+		ring_layout, q->in_ring.blk_nr);
+}
+
+/* Reserve dnr blocks of the IN_RING. Return 0 and the first reserved block
+ * in *start on success, -EAGAIN if there is no room.
+ *
+ * Should be called with preemption disabled because the producers behind us
+ * will spin in _ring_commit until we commit.
+ */
+static int _ring_reserve(struct rt_vbus_queue *q, int dnr, unsigned int *start)
+{
+	if (rt_vbus_ring_reserve(&q->in_ring, &q->in_reserve, dnr, start))
+		return -EAGAIN;
+	return 0;
+}
+
+/* Publish the blocks in [start, end). The reservations are published in the
+ * order they are made so wait for the producers in front of us first. gts is
+ * the post stamp of the messages in them, see rt_vbus_lat_gstamp.
+ *
+ * Return non-zero if the other side should be notified.
+ */
+static int _ring_commit(struct rt_vbus_queue *q,
+			unsigned int start, unsigned int end, u32 gts)
+{
+	rt_vbus_lat_put_stamp(q - _queues, start, end, q->in_ring.blk_nr, gts);
+	rt_vbus_ring_commit(&q->in_ring, start, end);
+
+	if (!_has_feature(RT_VBUS_F_EVENT_IDX))
+		return 1;
+
+	/* put_idx should be visible before we read the event. */
+	smp_mb();
+	return rt_vbus_need_event(*q->in_ring.put_event, end, start,
+				  q->in_ring.blk_nr);
+}
+
+static int _vbus_do_post_check_space(struct rt_vbus_queue *q, int dnr)
+{
+	int space = rt_vbus_ring_free_nr(&q->in_ring, &q->in_reserve);
+	unsigned int idx = RT_VBUS_RSV_IDX(atomic64_read(&q->in_reserve));
+	unsigned int evt;
+
+	/* Count the tail skipped by the V3 ring too. */
+	dnr = rt_vbus_ring_rsv_nr(&q->in_ring, idx, dnr);
+	if (space >= dnr)
+		return 1;
+
+	/* The event stays the same while the other side drains, as the space
+	 * grows with get_idx. Only notify when the request changes, a full
+	 * ring polled over and over would send an IPI each time otherwise. */
+	evt = (*q->in_ring.get_idx + dnr - space - 1) % q->in_ring.blk_nr;
+	if (*q->in_ring.blocked && *q->in_ring.get_event == evt)
+		return 0;
+
+	/* Ask to be woken up when there is room for dnr blocks. */
+	*q->in_ring.get_event = evt;
+	smp_wmb();
+	*q->in_ring.blocked = 1;
+	smp_wmb();
+	rt_vbus_notify_host(q);
+	return 0;
+}
+
+/* Drop the request for the kick once we got the space. Leave it armed if
+ * anyone else is waiting for the space. A waiter coming in between is woken
+ * up to arm it again. */
+static void _ring_unblock(struct rt_vbus_queue *q)
+{
+	if (waitqueue_active(&q->post_wait))
+		return;
+
+	*q->in_ring.blocked = 0;
+	smp_mb();
+	if (waitqueue_active(&q->post_wait))
+		wake_up_interruptible_all(&q->post_wait);
+}
 
-		if (chnr == 0 || chnr >= RT_VBUS_CHANNEL_NR)
-			break;
+/* Reserve dnr blocks, sleep until there is enough space. Return with
+ * preemption disabled on success. */
+static int _ring_reserve_wait(struct rt_vbus_queue *q, unsigned char id,
+			      int dnr, unsigned int *start)
+{
+	int res;
 
-		if (_chn_status[chnr] != RT_VBUS_CHN_ST_ESTABLISHED)
-			break;
+	for (;;) {
+		u64 t;
 
-		_chn_status[chnr] = RT_VBUS_CHN_ST_SUSPEND;
-#endif
+		preempt_disable();
+		if (_ring_reserve(q, dnr, start) == 0)
+			break;
+		preempt_enable();
+
+		rt_vbus_stat_inc(id, RT_VBUS_STAT_RING_WAITS);
+		t = rt_vbus_stat_clock();
+		/* Wait for enough space first. Don't remember to set the
+		 * blocked flag. */
+		res = wait_event_interruptible(q->post_wait,
+					       _vbus_do_post_check_space(q, dnr));
+		rt_vbus_stat_add(id, RT_VBUS_STAT_RING_WAIT_NS,
+				 rt_vbus_stat_clock() - t);
+		if (res)
+			return res;
 	}
-		break;
-	case RT_VBUS_CHN0_CMD_RESUME: {
-#ifdef RT_VBUS_USING_FLOW_CONTROL
-		unsigned char chnr = dp[1];
 
-		if (chnr == 0 || chnr >= RT_VBUS_CHANNEL_NR)
-			break;
+	if (*q->in_ring.blocked)
+		_ring_unblock(q);
+	return 0;
+}
 
-		if (_chn_status[chnr] != RT_VBUS_CHN_ST_SUSPEND)
-			break;
+/* Write the fragments of a message from the block idx. */
+static unsigned int _ring_put_msg(struct rt_vbus_queue *q, unsigned int idx,
+				  unsigned char id, unsigned char prio,
+				  const void *data, size_t len)
+{
+	const char *dp = data;
+	int frag = _has_feature(RT_VBUS_F_FRAG);
 
-		_chn_status[chnr] = RT_VBUS_CHN_ST_ESTABLISHED;
+	while (len) {
+		size_t putsz = min_t(size_t, len, q->in_ring.max_pkt);
 
-		wake_up_interruptible_all(&_chn_suspended_threads[chnr]);
-#endif
+		idx  = rt_vbus_ring_put_frag(&q->in_ring, idx, id, prio, dp, putsz,
+					     frag && len > putsz);
+		dp  += putsz;
+		len -= putsz;
 	}
-		break;
-	default:
-		/* just ignore the invalid cmd */
-		printk("VMM/Bus: unknown cmd %d on chn0\n", *dp);
-		break;
-	};
-	return 0;
+	return idx;
 }
 
-static wait_queue_head_t _do_post_wait;
+/* Number of blocks taken by a message, including the fragments. */
+static int _msg_bnr(struct rt_vbus_queue *q, size_t len)
+{
+	unsigned int max = q->in_ring.max_pkt;
+	int nr = (len / max) * rt_vbus_ring_pkt_nr(&q->in_ring, max);
+
+	if (len % max)
+		nr += rt_vbus_ring_pkt_nr(&q->in_ring, len % max);
+	return nr;
+}
 
-static int _vbus_do_post_check_space(struct rt_vbus_ring *rg, int dnr)
+/* Whether the ring has room for the message now. If not, ask the other side
+ * to kick us once it has. */
+static int _vbus_post_has_room(struct rt_vbus_queue *q, size_t len)
 {
-	if (_bus_ring_space_nr(rg) >= dnr)
-		return 1;
+	int dnr = _msg_bnr(q, len);
 
-	rg->blocked = 1;
-	smp_wmb();
-	rt_vbus_notify_host();
+	/* Messages bigger than the ring are put piece by piece. */
+	if (dnr > rt_vbus_ring_max_nr(&q->in_ring))
+		dnr = rt_vbus_ring_pkt_nr(&q->in_ring, q->in_ring.max_pkt);
+	return _vbus_do_post_check_space(q, dnr);
+}
+
+#ifdef RT_VBUS_USING_DIRECT_POST
+/* Write the message into the IN_RING in the context of the caller.
+ *
+ * It only happens when there is no pkg pending in the prio queue(so no
+ * higher priority data is overtaken) and the ring has room for the whole
+ * message. Otherwise return -EAGAIN and the caller should go through the prio
+ * queue. Several CPUs could be here at the same time.
+ */
+static int _vbus_post_direct(struct rt_vbus_queue *q,
+			     unsigned char id, unsigned char prio,
+			     const void *data, size_t len, u32 gts)
+{
+	int kick, dnr;
+	unsigned int start, idx;
+
+	if (atomic_read(&q->in_pending))
+		return -EAGAIN;
+
+	dnr = _msg_bnr(q, len);
+	if (dnr > rt_vbus_ring_max_nr(&q->in_ring))
+		return -EAGAIN;
+
+	preempt_disable();
+	if (_ring_reserve(q, dnr, &start)) {
+		preempt_enable();
+		return -EAGAIN;
+	}
+
+	idx  = rt_vbus_ring_data_start(&q->in_ring, start, dnr);
+	kick = _ring_commit(q, start, _ring_put_msg(q, idx, id, prio, data, len),
+			    gts);
+	preempt_enable();
+
+	trace_vbus_do_post(id, prio, len, 1);
+
+	if (kick)
+		_vbus_kick_host(q);
+
+	rt_vbus_stat_inc(id, RT_VBUS_STAT_TX_PKTS);
+	rt_vbus_stat_add(id, RT_VBUS_STAT_TX_BYTES, len);
 	return 0;
 }
+#endif
 
-static int _vbus_do_post(unsigned char id, unsigned char prio,
-			 const void *data, size_t len)
+static int _vbus_do_post(struct rt_vbus_queue *q,
+			 unsigned char id, unsigned char prio,
+			 const void *data, size_t len, int more, u32 gts)
 {
-	int dnr, res;
-	unsigned int nxtidx;
+	int res, kick;
+	unsigned int start;
 
 	if (id >= RT_VBUS_CHANNEL_NR || !_chn_connected(id))
 		return -EINVAL;
@@ -833,185 +2133,609 @@ static int _vbus_do_post(unsigned char id, unsigned char prio,
 	rt_wm_que_dec(&_chn_wm_que[id]);
 #endif
 
-	BUG_ON(len > RT_VBUS_MAX_PKT_SZ);
-	dnr = LEN2BNR(len);
+	BUG_ON(len > q->in_ring.max_pkt);
 
-	/* Wait for enough space first. Don't remember to set the blocked flag.
-	 */
-	res = wait_event_interruptible(_do_post_wait,
-				       _vbus_do_post_check_space(IN_RING, dnr));
+	res = _ring_reserve_wait(q, id, rt_vbus_ring_pkt_nr(&q->in_ring, len),
+				 &start);
 	if (res)
 		return res;
 
-	IN_RING->blocked = 0;
+	trace_vbus_do_post(id, prio, len, 0);
+
+	kick = _ring_commit(q, start,
+			    rt_vbus_ring_put_frag(&q->in_ring, start, id, prio, data, len,
+						  more && _has_feature(RT_VBUS_F_FRAG)),
+			    gts);
+	preempt_enable();
+
+	if (kick)
+		_vbus_kick_host(q);
+
+	rt_vbus_stat_inc(id, RT_VBUS_STAT_TX_PKTS);
+	rt_vbus_stat_add(id, RT_VBUS_STAT_TX_BYTES, len);
+	return len;
+}
+
+/* Post a message bigger than a reservation packet by packet. Return the kick
+ * of the last commit or negative error. */
+static int _vbus_post_pieces(struct rt_vbus_queue *q,
+			     unsigned char id, unsigned char prio,
+			     const char *dp, size_t len, u32 gts)
+{
+	int res, kick = 0;
+	unsigned int start;
+
+	while (len) {
+		size_t putsz = min_t(size_t, len, q->in_ring.max_pkt);
 
-	/*
-	 *pr_info("post for user chn %d, prio %d, len %d\n",
-	 *        id, prio, len);
-	 */
+		res = _ring_reserve_wait(q, id,
+					 rt_vbus_ring_pkt_nr(&q->in_ring, putsz),
+					 &start);
+		if (res)
+			return res;
+		kick = _ring_commit(q, start,
+				    rt_vbus_ring_put_frag(&q->in_ring, start,
+							  id, prio, dp, putsz,
+							  len > putsz &&
+							  _has_feature(RT_VBUS_F_FRAG)),
+				    gts);
+		preempt_enable();
+
+		dp  += putsz;
+		len -= putsz;
+		/* Let the other side drain what we have. */
+		if (kick && len)
+			rt_vbus_notify_host(q);
+	}
 
-	nxtidx = IN_RING->put_idx + dnr;
+	return kick;
+}
 
-	IN_RING->blks[IN_RING->put_idx].id  = id;
-	IN_RING->blks[IN_RING->put_idx].qos = prio;
-	IN_RING->blks[IN_RING->put_idx].len = len;
+/* Post a batch of messages with few put_idx updates and notifications.
+ *
+ * The messages are grouped up to post_batch_max bytes and each group is put
+ * with one reservation. A message bigger than that goes alone, packet by
+ * packet.
+ *
+ * Return the number of messages committed, or the error if there is none.
+ */
+static int _vbus_do_post_batch(struct rt_vbus_queue *q,
+			       unsigned char id, unsigned char prio,
+			       const struct rt_vbus_msg *msgs, unsigned int nr,
+			       u32 gts)
+{
+	int res = 0, kick = 0;
+	unsigned int i, j, start, idx;
+	unsigned int maxnr = rt_vbus_ring_max_nr(&q->in_ring);
+	size_t limit = max_t(size_t, post_batch_max, q->in_ring.max_pkt);
+	size_t bytes = 0;
 
-	if (nxtidx >= RT_VMM_RB_BLK_NR) {
-		unsigned int tailsz;
+	if (id >= RT_VBUS_CHANNEL_NR || !_chn_connected(id))
+		return -EINVAL;
 
-		tailsz = (RT_VMM_RB_BLK_NR - IN_RING->put_idx)
-			* sizeof(IN_RING->blks[0]) - RT_VBUS_BLK_HEAD_SZ;
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	rt_wm_que_dec(&_chn_wm_que[id]);
+#endif
 
-		/* the remaining block is sufficient for the data */
-		if (tailsz > len)
-			tailsz = len;
+	for (i = 0; i < nr; i = j) {
+		unsigned int gnr = 0;
+		size_t gbytes = 0;
 
-		memcpy(&IN_RING->blks[IN_RING->put_idx].data,
-		       data, tailsz);
-		memcpy(&IN_RING->blks[0], ((char*)data)+tailsz,
-		       len - tailsz);
+		/* Let the other side drain the last group. */
+		if (kick)
+			rt_vbus_notify_host(q);
 
-		smp_wmb();
-		IN_RING->put_idx = nxtidx - RT_VMM_RB_BLK_NR;
-	} else {
-		memcpy(&IN_RING->blks[IN_RING->put_idx].data,
-		       data, len);
+		for (j = i; j < nr; j++) {
+			unsigned int bnr = _msg_bnr(q, msgs[j].len);
 
-		smp_wmb();
-		IN_RING->put_idx = nxtidx;
+			if (j > i && (gbytes + msgs[j].len > limit ||
+				      gnr + bnr > maxnr))
+				break;
+			gnr    += bnr;
+			gbytes += msgs[j].len;
+		}
+
+		if (gbytes > limit || gnr > maxnr) {
+			kick = _vbus_post_pieces(q, id, prio,
+						 msgs[i].data, msgs[i].len, gts);
+			if (kick < 0) {
+				res = kick;
+				break;
+			}
+			bytes += gbytes;
+			continue;
+		}
+
+		res = _ring_reserve_wait(q, id, gnr, &start);
+		if (res)
+			break;
+
+		idx = rt_vbus_ring_data_start(&q->in_ring, start, gnr);
+		for (; i < j; i++)
+			idx = _ring_put_msg(q, idx, id, prio,
+					    msgs[i].data, msgs[i].len);
+		kick = _ring_commit(q, start, idx, gts);
+		preempt_enable();
+		bytes += gbytes;
 	}
 
-	smp_wmb();
-	rt_vbus_notify_host();
+	if (kick > 0)
+		_vbus_kick_host(q);
 
-	return len;
+	rt_vbus_stat_add(id, RT_VBUS_STAT_TX_PKTS, i);
+	rt_vbus_stat_add(id, RT_VBUS_STAT_TX_BYTES, bytes);
+	return i ? i : res;
 }
 
 static void _havest_in_data(struct work_struct *work)
 {
-	int res;
+	int res, err;
 	struct rt_vbus_pkg pkg;
+	struct rt_vbus_queue *q = container_of(work, struct rt_vbus_queue,
+					       in_wk);
 
-	for (res = rt_prio_queue_trypop(_prio_que, (char*)&pkg);
+	for (res = rt_prio_queue_trypop(q->prio_que, (char*)&pkg);
 	     res == 0;
-	     res = rt_prio_queue_trypop(_prio_que, (char*)&pkg)) {
-		_vbus_do_post(pkg.id, pkg.prio,
-			      pkg.data, pkg.len);
+	     res = rt_prio_queue_trypop(q->prio_que, (char*)&pkg)) {
+		if (pkg.msgs) {
+			err = _vbus_do_post_batch(q, pkg.id, pkg.prio,
+						  pkg.msgs, pkg.nr, pkg.gts);
+		} else if (pkg.done) {
+			struct rt_vbus_msg msg = {pkg.data, pkg.len};
+
+			err = _vbus_do_post_batch(q, pkg.id, pkg.prio, &msg, 1,
+						  pkg.gts);
+		} else {
+			err = _vbus_do_post(q, pkg.id, pkg.prio,
+					    pkg.data, pkg.len, pkg.more,
+					    pkg.gts);
+		}
+		rt_vbus_lat_account(pkg.id, RT_VBUS_LAT_POST_COMMIT, pkg.ts);
+		atomic_dec(&q->in_pending);
+		if (pkg.res)
+			*pkg.res = err;
 		if (pkg.cmp)
 			complete(pkg.cmp);
+		if (pkg.done)
+			pkg.done(pkg.arg, err < 0 ? err : 0);
 	}
 }
 
-static irqreturn_t _vbus_isr(int irq,  void *dev_id)
+/* Hand the packet at the block get of the OUT_RING of the queue to the
+ * channel. Return
+ * -ENOMEM if there is no buffer for it, the packet is left in the ring then.
+ * A packet dropped for the full rxmap counts as delivered. */
+static int _rx_deliver(struct rt_vbus_queue *q,
+		       unsigned int id, unsigned int get,
+		       void *data, size_t size)
 {
-	/* while(not empty) */
-	while (OUT_RING->get_idx != OUT_RING->put_idx) {
-		size_t size;
-		struct rt_vbus_data *dp;
-		unsigned int id, nxtidx;
-		unsigned int tailsz;
+	struct rt_vbus_ring_ctx *rg = &q->out_ring;
+	struct rt_vbus_data *dp;
+	unsigned int tailsz;
+	int err;
 
-		size = OUT_RING->blks[OUT_RING->get_idx].len;
-		id   = OUT_RING->blks[OUT_RING->get_idx].id;
+	tailsz = rt_vbus_ring_pkt_tailsz(rg, get, size);
+	BUG_ON(tailsz > size);
 
-		/*
-		 *pr_info("get pkg for chn %d, len %d\n",
-		 *        id, size);
-		 */
+	/* Copy the data into the mmaped area directly if there is one. */
+	err = _rxmap_push(id,
+			  data, tailsz,
+			  &rg->blks[0], size - tailsz);
+	if (err == -ENOSPC) {
+		pr_info("drop on rxmap full\n");
+		rt_vbus_stat_inc(id, RT_VBUS_STAT_DROP_RXMAP);
+		return 0;
+	} else if (err == 0) {
+		rt_vbus_stat_inc(id, RT_VBUS_STAT_RX_PKTS);
+		rt_vbus_stat_add(id, RT_VBUS_STAT_RX_BYTES, size);
+		rt_vbus_notify_chn(id);
+		return 0;
+	}
+
+	dp = _rx_alloc(id, size);
+	if (!dp)
+		return -ENOMEM;
+
+	memcpy(dp + 1, data, tailsz);
+	memcpy((char*)(dp + 1) + tailsz, &rg->blks[0],
+	       size - tailsz);
+	/* Old peers leave garbage in the flags. */
+	if (_has_feature(RT_VBUS_F_FRAG))
+		dp->more = !!rt_vbus_ring_pkt_more(rg, get);
+	rt_vbus_data_push(id, dp);
+	rt_vbus_stat_inc(id, RT_VBUS_STAT_RX_PKTS);
+	rt_vbus_stat_add(id, RT_VBUS_STAT_RX_BYTES, size);
+
+	rt_vbus_notify_chn(id);
+	return 0;
+}
+
+/* Drain at most budget packets from the OUT_RING of the queue. Return the
+ * number of packets handled, or -ENOMEM if it stopped on a packet without a
+ * buffer. */
+static int _vbus_drain(struct rt_vbus_queue *q, int budget)
+{
+	struct rt_vbus_ring_ctx *rg = &q->out_ring;
+	int done;
+
+	for (done = 0; done < budget && rt_vbus_ring_has_data(rg); done++) {
+		size_t size;
+		unsigned int id;
+		unsigned int get = *rg->get_idx;
+		void *data;
+
+		data = rt_vbus_ring_pkt(rg, get, &id, &size);
+		/* Skip the PAD and the packets taken by _vbus_rx_urgent. */
+		if (!data || test_bit(get, q->rx_taken)) {
+			if (data)
+				__clear_bit(get, q->rx_taken);
+			rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+			continue;
+		}
+
+		trace_vbus_recv(id, size);
 
 		/* Suspended channel can still recv data. */
-		if (id > RT_VBUS_CHANNEL_NR || !_chn_connected(id)) {
+		if (id >= RT_VBUS_CHANNEL_NR) {
+			pr_info("drop invalid packet by id(%d), %d\n", id, size);
+			rt_vbus_stat_inc(0, RT_VBUS_STAT_DROP_INVALID);
+			rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+			continue;
+		}
+
+		if (!_chn_connected(id)) {
 			/* drop the invalid packet */
 			if (!(_chn_status[id] == RT_VBUS_CHN_ST_CLOSED ||
-			      _chn_status[id] == RT_VBUS_CHN_ST_CLOSING))
+			      _chn_status[id] == RT_VBUS_CHN_ST_CLOSING)) {
 				pr_info("drop invalid packet by id(%d), %d, %d\n",
 					id, size, _chn_status[id]);
-			_ring_add_get_bnr(OUT_RING, LEN2BNR(size));
+				rt_vbus_stat_inc(id, RT_VBUS_STAT_DROP_INVALID);
+			} else {
+				rt_vbus_stat_inc(id, RT_VBUS_STAT_DROP_CLOSED);
+			}
+			rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
 			continue;
 		}
 
 		if (id == 0) {
+			if (q->nr != 0) {
+				pr_info("drop chn0 packet on queue %d\n", q->nr);
+				rt_vbus_stat_inc(0, RT_VBUS_STAT_DROP_INVALID);
+				rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+				continue;
+			}
+			rt_vbus_stat_inc(0, RT_VBUS_STAT_RX_PKTS);
+			rt_vbus_stat_add(0, RT_VBUS_STAT_RX_BYTES, size);
 			if (size > 60)
 				pr_err("too big(%d) packet on chn0\n", size);
 			else
-				_chn0_actor(OUT_RING->blks[OUT_RING->get_idx].data, size);
-			_ring_add_get_bnr(OUT_RING, LEN2BNR(size));
+				_chn0_actor(data, size);
+			rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+			/* The ACK of the layout is the last packet in the old
+			 * layout. */
+			if (_out_layout_pending)
+				_out_ring_switch();
 			continue;
 		}
 
-		dp = kmalloc(size + sizeof(*dp), GFP_KERNEL);
-		if (!dp) {
-			pr_info("drop on kmalloc fail\n");
-			_ring_add_get_bnr(OUT_RING, LEN2BNR(size));
-			continue;
+		if (_rx_deliver(q, id, get, data, size)) {
+			/* Leave the packet in the ring. The other side will
+			 * be blocked when it is full. */
+			rt_vbus_stat_inc(id, RT_VBUS_STAT_RX_STALLS);
+			return -ENOMEM;
 		}
-		dp->size = size;
-		dp->next = NULL;
 
-		nxtidx = OUT_RING->get_idx + LEN2BNR(size);
-		if (nxtidx == RT_VMM_RB_BLK_NR) {
-			memcpy(dp+1, &OUT_RING->blks[OUT_RING->get_idx].data, size);
-			rt_vbus_data_push(id, dp);
+		rt_vbus_ring_add_get_bnr(rg, rt_vbus_ring_pkt_nr(rg, size));
+	}
 
-			OUT_RING->get_idx = nxtidx - RT_VMM_RB_BLK_NR;
+	return done;
+}
 
-			rt_vbus_notify_chn(id);
-			continue;
-		} else if (nxtidx < RT_VMM_RB_BLK_NR) {
-			memcpy(dp+1, &OUT_RING->blks[OUT_RING->get_idx].data, size);
-			rt_vbus_data_push(id, dp);
+/* Take the urgent packets out of the backlog ahead of the drain.
+ *
+ * A packet is urgent if its qos, the priority it is posted with, is below
+ * rx_urgent_prio. It is only taken if no earlier packet of the same channel
+ * is left in the ring, so each channel still sees its packets in order. The
+ * slot stays in the ring until the drain reaches it and skips it.
+ */
+static void _vbus_rx_urgent(struct rt_vbus_queue *q)
+{
+	struct rt_vbus_ring_ctx *rg = &q->out_ring;
+	unsigned int prio = ACCESS_ONCE(rx_urgent_prio);
+	unsigned int get = *rg->get_idx;
+	unsigned int put, i;
+	DECLARE_BITMAP(behind, RT_VBUS_CHANNEL_NR);
+
+	if (!prio)
+		return;
 
-			OUT_RING->get_idx = nxtidx;
+	put = *rg->put_idx;
+	smp_rmb();
 
-			rt_vbus_notify_chn(id);
-			continue;
+	bitmap_zero(behind, RT_VBUS_CHANNEL_NR);
+	for (i = 0; i < _RX_SCAN_MAX && get != put; i++) {
+		unsigned int id;
+		size_t size;
+		void *data = rt_vbus_ring_pkt(rg, get, &id, &size);
+		unsigned int nxt = get + rt_vbus_ring_pkt_nr(rg, size);
+
+		if (nxt >= rg->blk_nr)
+			nxt -= rg->blk_nr;
+
+		if (!data || test_bit(get, q->rx_taken) ||
+		    id == 0 || id >= RT_VBUS_CHANNEL_NR)
+			goto _next;
+
+		if (rt_vbus_ring_pkt_qos(rg, get) >= prio ||
+		    test_bit(id, behind) || !_chn_connected(id)) {
+			__set_bit(id, behind);
+			goto _next;
 		}
 
-		/* nxtidx > RT_VMM_RB_BLK_NR, join the data into a continuous
-		 * region. */
-		tailsz = (RT_VMM_RB_BLK_NR - OUT_RING->get_idx)
-			* sizeof(OUT_RING->blks[0]) - RT_VBUS_BLK_HEAD_SZ;
+		trace_vbus_recv(id, size);
+		if (_rx_deliver(q, id, get, data, size))
+			return;
+		__set_bit(get, q->rx_taken);
+		rt_vbus_stat_inc(id, RT_VBUS_STAT_RX_URGENT);
+_next:
+		get = nxt;
+	}
+}
+
+/* Wake up the other side if it is blocked on the space we just freed. */
+static void _vbus_wake_producer(struct rt_vbus_queue *q, unsigned int old_get)
+{
+	struct rt_vbus_ring_ctx *rg = &q->out_ring;
 
-		BUG_ON(tailsz > size);
+	smp_rmb();
+	if (*rg->blocked &&
+	    (!_has_feature(RT_VBUS_F_EVENT_IDX) ||
+	     rt_vbus_need_event(*rg->get_event, *rg->get_idx, old_get,
+				rg->blk_nr)))
+		rt_vbus_notify_host(q);
+}
 
-		memcpy(dp + 1, &OUT_RING->blks[OUT_RING->get_idx].data,
-		       tailsz);
-		memcpy((char*)(dp + 1) + tailsz, &OUT_RING->blks[0],
-		       size - tailsz);
-		rt_vbus_data_push(id, dp);
+/* Spin for busy_poll_us waiting for the next packet. Return non-zero if it
+ * came. */
+static int _vbus_busy_poll(struct rt_vbus_queue *q)
+{
+	u64 end = ktime_get_ns() + (u64)busy_poll_us * NSEC_PER_USEC;
 
-		OUT_RING->get_idx = nxtidx - RT_VMM_RB_BLK_NR;
+	do {
+		if (rt_vbus_ring_has_data(&q->out_ring))
+			return 1;
+		cpu_relax();
+	} while (ktime_get_ns() < end && !need_resched());
 
-		rt_vbus_notify_chn(id);
+	return 0;
+}
+
+/* Drain the OUT_RING until it is empty, NAPI style.
+ *
+ * With the event index the other side only notifies when put_idx passes
+ * put_event, so the notifications stay off while we don't move it. It is
+ * moved only when the ring is found empty, then the ring is checked again in
+ * case a packet came in before the event is seen. Without the event index
+ * the IPIs in between only mark the poller to run once more.
+ *
+ * Return -ENOMEM if the drain is stalled on the receive buffers.
+ */
+static int _vbus_poll(struct rt_vbus_queue *q)
+{
+	struct rt_vbus_ring_ctx *rg = &q->out_ring;
+	int budget = rx_budget ? rx_budget : 1;
+
+	for (;;) {
+		unsigned int old_get = *rg->get_idx;
+		int done = _vbus_drain(q, budget);
+
+		_vbus_wake_producer(q, old_get);
+		if (done < 0)
+			return done;
+
+		if (done == budget) {
+			/* There is a backlog. Don't let the urgent packets
+			 * wait for it. */
+			_vbus_rx_urgent(q);
+			cond_resched();
+			continue;
+		}
+
+		if (busy_poll_us && _vbus_busy_poll(q))
+			continue;
+
+		if (!_has_feature(RT_VBUS_F_EVENT_IDX))
+			return 0;
+
+		*rg->put_event = *rg->get_idx;
+		smp_mb();
+		if (!rt_vbus_ring_has_data(rg))
+			return 0;
 	}
+}
 
-	smp_rmb();
-	if (OUT_RING->blocked)
-		rt_vbus_notify_host();
+static int _rx_poller(void *arg)
+{
+	struct rt_vbus_queue *q = arg;
 
-	return IRQ_HANDLED;
+	while (!kthread_should_stop()) {
+		int res;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_xchg(&q->rx_sched, 0)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		rt_vbus_lat_account(0, RT_VBUS_LAT_IPI_DRAIN,
+				    atomic64_xchg(&q->rx_ipi_ts, 0));
+
+		mutex_lock(&q->rx_drain_lock);
+		res = _vbus_poll(q);
+		mutex_unlock(&q->rx_drain_lock);
+
+		if (res == -ENOMEM) {
+			/* Wait for a buffer given back, or try again
+			 * later. */
+			atomic_set(&q->rx_stalled, 1);
+			schedule_timeout_interruptible(HZ / 100);
+			atomic_set(&q->rx_sched, 1);
+		}
+	}
+
+	return 0;
 }
 
-static void _vbus_isr_bridge(struct work_struct *work)
+int rt_vbus_busy_poll(unsigned char id, unsigned int us)
 {
-	_vbus_isr(0, NULL);
+	struct rt_vbus_queue *q;
+	u64 end;
+
+	if (id == 0 || id >= RT_VBUS_CHANNEL_NR)
+		return -EINVAL;
+	q = _chn_q(id);
+
+	end = ktime_get_ns() + (u64)us * NSEC_PER_USEC;
+	for (;;) {
+		if (!rt_vbus_data_empty(id))
+			return 0;
+		if (_chn_status[id] != RT_VBUS_CHN_ST_ESTABLISHED)
+			return -EPIPE;
+
+		/* Drain in the caller's context instead of waiting for the
+		 * poller to be scheduled. Leave it alone if it is already
+		 * running. */
+		if (rt_vbus_ring_has_data(&q->out_ring) &&
+		    mutex_trylock(&q->rx_drain_lock)) {
+			unsigned int old_get = *q->out_ring.get_idx;
+
+			_vbus_drain(q, rx_budget ? rx_budget : 1);
+			_vbus_wake_producer(q, old_get);
+			mutex_unlock(&q->rx_drain_lock);
+		} else {
+			cpu_relax();
+		}
+
+		if (ktime_get_ns() >= end || need_resched())
+			return rt_vbus_data_empty(id) ? -EAGAIN : 0;
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
 }
+EXPORT_SYMBOL(rt_vbus_busy_poll);
 
 static irqreturn_t _vbus_isr2(int irq,  void *dev_id)
 {
-	if (irq != RT_VBUS_GUEST_VIRQ) return IRQ_HANDLED;
+	struct rt_vbus_queue *q;
+	int qnr = (RT_VBUS_GUEST_VIRQ - irq) / 2;
+
+	/* The GUEST_VIRQ of the queue qnr is RT_VBUS_GUEST_VIRQ_Q(qnr). */
+	if (irq > RT_VBUS_GUEST_VIRQ || (RT_VBUS_GUEST_VIRQ - irq) % 2 ||
+	    qnr >= _queue_nr)
+		return IRQ_HANDLED;
+	q = &_queues[qnr];
 
-	if (IN_RING->blocked)
-		wake_up_interruptible_all(&_do_post_wait);
+	rt_vbus_stat_inc(0, RT_VBUS_STAT_IPI_RX);
+	if (unlikely(rt_vbus_lat_on))
+		atomic64_cmpxchg(&q->rx_ipi_ts, 0, rt_vbus_lat_stamp());
 
-	queue_work(_ring_wkq, &_ring_wk);
+	if (*q->in_ring.blocked)
+		wake_up_interruptible_all(&q->post_wait);
+
+	_rx_schedule(q);
 	return IRQ_HANDLED;
 }
 
-int driver_load(void __iomem *outr, void __iomem *inr)
+/* Set up the post worker and the poller of the queue. */
+static int _queue_init(struct rt_vbus_queue *q, unsigned int nr)
 {
 	int res;
 
+	q->nr = nr;
+	init_waitqueue_head(&q->post_wait);
+	mutex_init(&q->rx_drain_lock);
+	INIT_WORK(&q->in_wk, _havest_in_data);
+	hrtimer_init(&q->notify_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	q->notify_timer.function = _notify_timer_fn;
+
+	q->prio_que = rt_prio_queue_create("vbus", RT_VMM_RB_BLK_NR,
+					   sizeof(struct rt_vbus_pkg));
+	if (!q->prio_que)
+		return -ENOMEM;
+
+	q->in_wkq = alloc_ordered_workqueue("vbus_in%u", WQ_MEM_RECLAIM, nr);
+	if (!q->in_wkq) {
+		res = -ENOMEM;
+		goto _free_que;
+	}
+
+	q->rx_task = kthread_run(_rx_poller, q, "vbus_rx%u", nr);
+	if (IS_ERR(q->rx_task)) {
+		res = PTR_ERR(q->rx_task);
+		q->rx_task = NULL;
+		goto _free_wkq;
+	}
+
+	return 0;
+_free_wkq:
+	destroy_workqueue(q->in_wkq);
+_free_que:
+	rt_prio_queue_delete(q->prio_que);
+	q->prio_que = NULL;
+	return res;
+}
+
+static void _queue_deinit(struct rt_vbus_queue *q)
+{
+	if (!q->prio_que)
+		return;
+
+	hrtimer_cancel(&q->notify_timer);
+	cancel_work_sync(&q->in_wk);
+	destroy_workqueue(q->in_wkq);
+	kthread_stop(q->rx_task);
+	rt_prio_queue_delete(q->prio_que);
+	q->prio_que = NULL;
+}
+
+/* Empty a ring of an extra queue. */
+static void _ring_format(struct rt_vbus_ring_ctx *ctx, void *base, int layout)
+{
+	if (layout == RT_VBUS_LAYOUT_V1)
+		memset(base, 0, _RT_VBUS_RING_SZ);
+	else
+		rt_vbus_ring_v2_format(base, layout);
+	rt_vbus_ring_ctx_init(ctx, base, _RT_VBUS_RING_SZ, layout);
+}
+
+/* Format both rings of the extra queues in the layout of queue 0. We are the
+ * only one touching them until RT_VBUS_F_MQ is negotiated. */
+static void _vbus_queues_format(void __iomem **qbase)
+{
+	int i, layout = _queues[0].in_ring.layout;
+
+	for (i = 1; i < ARRAY_SIZE(_queues); i++) {
+		struct rt_vbus_queue *q = &_queues[i];
+
+		_ring_format(&q->out_ring, qbase[i], layout);
+		_ring_format(&q->in_ring, qbase[i] + _RT_VBUS_RING_SZ, layout);
+		rt_vbus_ring_reserve_init(&q->in_ring, &q->in_reserve);
+	}
+}
+
+static void _vbus_free_irq(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(_queues); i++)
+		free_irq(RT_VBUS_GUEST_VIRQ_Q(i) + _irq_offset, &_queues[i]);
+}
+
+int driver_load(void __iomem **qbase, void *bulk)
+{
+	int i, res;
+
 	_irq_offset = rt_vmm_get_int_offset();
 
 	if (_irq_offset < 0)
@@ -1019,6 +2743,10 @@ int driver_load(void __iomem *outr, void __iomem *inr)
 
 	pr_info("get irq offset: %d\n", _irq_offset);
 
+	res = rt_vbus_stats_init(bulk);
+	if (res)
+		return res;
+
 #ifdef CONFIG_ARM_GIC
 	{
 		typedef int (*smp_ipi_handler_t)(int irq, void *devid);
@@ -1029,100 +2757,126 @@ int driver_load(void __iomem *outr, void __iomem *inr)
 	    res = 0;
 	}
 #else
-	res = request_irq(RT_VBUS_GUEST_VIRQ + _irq_offset,
-			  _vbus_isr2, IRQF_ONESHOT,
-			  "VMM-BUS", NULL);
+	for (i = 0; i < ARRAY_SIZE(_queues); i++) {
+		res = request_irq(RT_VBUS_GUEST_VIRQ_Q(i) + _irq_offset,
+				  _vbus_isr2, IRQF_ONESHOT,
+				  "VMM-BUS", &_queues[i]);
+		if (res) {
+			while (i--)
+				free_irq(RT_VBUS_GUEST_VIRQ_Q(i) + _irq_offset,
+					 &_queues[i]);
+			break;
+		}
+	}
 #endif
 	if (res) {
 		pr_err("error request RTT VMM bus irq: %d\n", res);
-		return res;
+		goto _free_stats;
 	}
 
-	_prio_que = rt_prio_queue_create("vbus", RT_VMM_RB_BLK_NR, sizeof(struct rt_vbus_pkg));
-	if (!_prio_que) {
-		res = -ENOMEM;
-		goto _free_irq;
+	for (i = 0; i < ARRAY_SIZE(_queues); i++) {
+		res = _queue_init(&_queues[i], i);
+		if (res)
+			goto _free_queues;
 	}
 
-	init_waitqueue_head(&_do_post_wait);
-	_ring_in_wkq = create_singlethread_workqueue("vbus_in");
-	if (!_ring_in_wkq) {
-		res = -ENOMEM;
-		goto _free_que;
+	memset(_chn_status, RT_VBUS_CHN_ST_AVAILABLE, sizeof(_chn_status));
+	bitmap_zero(_chn_used, RT_VBUS_CHANNEL_NR);
+
+	for (i = 0; i < ARRAY_SIZE(_chn_rxq); i++) {
+		spin_lock_init(&_chn_rxq[i].lock);
+		mutex_init(&_chn_rxq[i].wm_lock);
 	}
+	_chn_set_status(0, RT_VBUS_CHN_ST_ESTABLISHED);
 
-	_ring_wkq = create_singlethread_workqueue("vbus");
-	if (!_ring_wkq) {
-		res = -ENOMEM;
-		goto _free_que;
+#ifdef RT_VBUS_USING_FLOW_CONTROL
+	for (i = 0; i < ARRAY_SIZE(_chn_wm_que); i++) {
+		rt_wm_que_init(&_chn_wm_que[i],
+			       RT_VMM_RB_BLK_NR / 3,
+			       RT_VMM_RB_BLK_NR * 2 / 3);
 	}
+	/* Channel 0 has the full channel. */
+	rt_wm_que_set_mark(&_chn_wm_que[0], 0, -1);
 
-	memset(_chn_status, RT_VBUS_CHN_ST_AVAILABLE, sizeof(_chn_status));
-	_chn_status[0] = RT_VBUS_CHN_ST_ESTABLISHED;
+	for (i = 0; i < ARRAY_SIZE(_chn_suspended_threads); i++) {
+		init_waitqueue_head(&_chn_suspended_threads[i]);
+	}
 
-#ifdef RT_VBUS_USING_FLOW_CONTROL
-	{
-		int i;
+	for (i = 1; i < ARRAY_SIZE(_chn_recv_wm); i++) {
+		rt_vbus_set_recv_wm(i,
+				    RT_VMM_RB_BLK_NR / 3,
+				    RT_VMM_RB_BLK_NR * 2 / 3);
+		_chn_recv_wm[i].level = 0;
+		_chn_recv_wm[i].last_warn = 0;
+	}
+	/* Channel 0 has the full channel. Don't suspend it. */
+	_chn_recv_wm[0].low_mark = 0;
+	_chn_recv_wm[0].high_mark = -1;
+	_chn_recv_wm[0].level = 0;
+	_chn_recv_wm[0].last_warn = 0;
+#endif
 
-		for (i = 0; i < ARRAY_SIZE(_chn_wm_que); i++) {
-			rt_wm_que_init(&_chn_wm_que[i],
-				       RT_VMM_RB_BLK_NR / 3,
-				       RT_VMM_RB_BLK_NR * 2 / 3);
-		}
-		/* Channel 0 has the full channel. */
-		rt_wm_que_set_mark(&_chn_wm_que[0], 0, -1);
+#ifdef RT_VBUS_USING_BULK
+	res = rt_vbus_bulk_init(bulk, _RT_VBUS_BULK_SZ);
+	if (res)
+		goto _free_queues;
+#endif
 
-		for (i = 0; i < ARRAY_SIZE(_chn_suspended_threads); i++) {
-			init_waitqueue_head(&_chn_suspended_threads[i]);
-		}
+	rt_vbus_ring_ctx_init(&_queues[0].out_ring, qbase[0], _RT_VBUS_RING_SZ,
+			      RT_VBUS_LAYOUT_V1);
+	rt_vbus_ring_ctx_init(&_queues[0].in_ring, qbase[0] + _RT_VBUS_RING_SZ,
+			      _RT_VBUS_RING_SZ, RT_VBUS_LAYOUT_V1);
+	rt_vbus_ring_reserve_init(&_queues[0].in_ring, &_queues[0].in_reserve);
 
-		for (i = 1; i < ARRAY_SIZE(_chn_recv_wm); i++) {
-			rt_vbus_set_recv_wm(i,
-					    RT_VMM_RB_BLK_NR / 3,
-					    RT_VMM_RB_BLK_NR * 2 / 3);
-			_chn_recv_wm[i].level = 0;
-			_chn_recv_wm[i].last_warn = 0;
-		}
-		/* Channel 0 has the full channel. Don't suspend it. */
-		_chn_recv_wm[0].low_mark = 0;
-		_chn_recv_wm[0].high_mark = -1;
-		_chn_recv_wm[0].level = 0;
-		_chn_recv_wm[0].last_warn = 0;
+	_vbus_layout_negotiate();
+	/* Before asking for RT_VBUS_F_MQ. */
+	_vbus_queues_format(qbase);
+
+	/* Wake us up on the first packet once the event index is enabled. */
+	for (i = 0; i < ARRAY_SIZE(_queues); i++)
+		*_queues[i].out_ring.put_event = *_queues[i].out_ring.get_idx;
+	smp_wmb();
+
+	if (_LOCAL_FEATURES) {
+		unsigned char buf[2] = {RT_VBUS_CHN0_CMD_FEATURE,
+					_LOCAL_FEATURES};
+
+		pr_info("%s --> remote\n", dump_cmd_pkt(buf, sizeof(buf)));
+		rt_vbus_post(0, 0, buf, sizeof(buf));
 	}
-#endif
 
+	/* Let the users in only after the rings are settled. */
 	res = chn0_load();
 	if (res)
-		goto _free_wkq;
-
-	OUT_RING = outr;
-	IN_RING  = inr;
+		goto _free_bulk;
 
-	pr_info("VBus loaded: %d in blocks, %d out blocks\n",
-		RT_VMM_RB_BLK_NR, RT_VMM_RB_BLK_NR);
+	pr_info("VBus loaded: %d in blocks, %d out blocks, %d queues\n",
+		_queues[0].in_ring.blk_nr, _queues[0].out_ring.blk_nr,
+		RT_VBUS_QUEUE_NR);
 
 	return res;
-_free_wkq:
-	if (_ring_in_wkq)
-		destroy_workqueue(_ring_in_wkq);
-	if (_ring_wkq)
-		destroy_workqueue(_ring_wkq);
-_free_que:
-	rt_prio_queue_delete(_prio_que);
-_free_irq:
-	free_irq(RT_VBUS_GUEST_VIRQ + _irq_offset, NULL);
+_free_bulk:
+	rt_vbus_bulk_deinit();
+_free_queues:
+	for (i = 0; i < ARRAY_SIZE(_queues); i++)
+		_queue_deinit(&_queues[i]);
+	_vbus_free_irq();
+_free_stats:
+	rt_vbus_stats_deinit();
 	return res;
 }
 
 void driver_unload(void)
 {
+	int i;
+
 	chn0_unload();
+	cancel_work_sync(&_sess_enable_wk);
 
-	cancel_work_sync(&_ring_in_wk);
-	destroy_workqueue(_ring_in_wkq);
-	cancel_work_sync(&_ring_wk);
-	destroy_workqueue(_ring_wkq);
-	rt_prio_queue_delete(_prio_que);
+	for (i = 0; i < ARRAY_SIZE(_queues); i++)
+		_queue_deinit(&_queues[i]);
+	rt_vbus_bulk_deinit();
 
-	free_irq(RT_VBUS_GUEST_VIRQ + _irq_offset, NULL);
+	_vbus_free_irq();
+	rt_vbus_stats_deinit();
 }
@@ -31,7 +31,8 @@
 
 #include "rt_vbus_user.h"
 
-int driver_load(void __iomem *outr, void __iomem *inr);
+/* qbase[q] is the OUT_RING of the queue q, followed by its IN_RING. */
+int driver_load(void __iomem **qbase, void *bulk);
 void driver_unload(void);
 
 int rt_vbus_connection_ok(unsigned char chnr);
@@ -43,8 +44,79 @@ int rt_vbus_request_chn(struct rt_vbus_request *req,
 			rt_vbus_callback cb);
 void rt_vbus_close_chn(unsigned char);
 
+/* Called with the chnr, or negative error, once an async request is
+ * settled. It runs in the chn0 context so don't sleep in it. */
+typedef void (*rt_vbus_req_done)(void *arg, int chnr);
+/** Start a request for a channel without waiting for the other side.
+ *
+ * Return a handle of the request or negative error. req should be valid until
+ * the request is finished or canceled. The ENABLE packets of the requests
+ * started together are posted to chn0 in one batch.
+ */
+int rt_vbus_request_chn_async(struct rt_vbus_request *req,
+			      int is_server,
+			      rt_vbus_callback cb,
+			      rt_vbus_req_done done, void *arg);
+/** Free the handle of a settled request.
+ *
+ * Return the chnr or negative error, -EAGAIN if the request is not settled.
+ */
+int rt_vbus_request_finish(int handle);
+/* Give up the request. The channel established meanwhile is closed. */
+void rt_vbus_request_cancel(int handle);
+
 int rt_vbus_post(unsigned char id, unsigned char prio,
 		 const void *data, size_t len);
+/* Called with 0 or negative error once the message of rt_vbus_post_async is
+ * in the ring. It may run in the worker so don't sleep in it. */
+typedef void (*rt_vbus_post_done)(void *arg, int res);
+/* Return -EAGAIN instead of waiting for the room. */
+#define RT_VBUS_POST_NONBLOCK   0x1
+/** Post the message without waiting for it to get into the ring.
+ *
+ * The buffer belongs to VBUS until done is called, which may happen before
+ * the function returns. done is not called if the call fails. With
+ * RT_VBUS_POST_NONBLOCK, -EAGAIN is returned if the channel is suspended, the
+ * post water mark is reached or the ring has no room for the message.
+ */
+int rt_vbus_post_async(unsigned char id, unsigned char prio,
+		       const void *data, size_t len, int flags,
+		       rt_vbus_post_done done, void *arg);
+struct file;
+struct poll_table_struct;
+/** Poll the channel for the post.
+ *
+ * Return POLLOUT | POLLWRNORM if a RT_VBUS_POST_NONBLOCK post of a max packet
+ * would not fail with -EAGAIN now.
+ */
+unsigned int rt_vbus_post_poll(unsigned char id, struct file *filp,
+			       struct poll_table_struct *wait);
+/** Post nr messages in one go.
+ *
+ * The messages are put into the ring with one update of the ring index and
+ * one notification to the other side. The messages longer than the max
+ * packet of the ring layout are splitted just like rt_vbus_post.
+ *
+ * Return the number of messages posted, less than nr if the post stopped on
+ * an error, or the error if none is posted.
+ */
+int rt_vbus_post_batch(unsigned char id, unsigned char prio,
+		       const struct rt_vbus_msg *msgs, unsigned int nr);
+
+/** Buffers in the shared bulk region, for rt_vbus_post_bulk.
+ */
+void* rt_vbus_bulk_alloc(size_t size);
+void rt_vbus_bulk_free(void *buf);
+/* Whether the other side takes the bulk buffers. */
+int rt_vbus_bulk_supported(void);
+/** Post the buffer from rt_vbus_bulk_alloc without copying it into the ring.
+ *
+ * Only a small descriptor goes through the ring. The buffer is lent to the
+ * other side and freed when it is given back, so don't touch it once the call
+ * succeeded.
+ */
+int rt_vbus_post_bulk(unsigned char id, unsigned char prio,
+		      void *buf, size_t len);
 
 void rt_vbus_set_post_wm(unsigned char chnr,
 			 unsigned int low, unsigned int high);
@@ -54,11 +126,49 @@ void rt_vbus_set_recv_wm(unsigned char chnr,
 struct rt_vbus_data {
 	size_t size;
 	struct rt_vbus_data *next;
+	/* If not NULL, the data is in a bulk buffer of the other side instead
+	 * of following the struct. */
+	void *bulk;
+	/* The receive pool and the size class it comes from. NULL if it is
+	 * from kmalloc. */
+	struct rt_vbus_pool *pool;
+	unsigned int cls;
+	/* More fragments of the message follow. Only set once RT_VBUS_F_FRAG
+	 * is negotiated. */
+	int more;
+	/* Taken off the ring at, for the latency histograms. 0 if not
+	 * stamped. */
+	u64 ts;
 	/* data follows */
 };
 
+static inline void* rt_vbus_data_buf(struct rt_vbus_data *dat)
+{
+	return dat->bulk ? dat->bulk : dat + 1;
+}
+
 struct rt_vbus_data* rt_vbus_data_pop(unsigned char chnr);
+/* Free the data from rt_vbus_data_pop. */
+void rt_vbus_data_free(struct rt_vbus_data *dat);
 int rt_vbus_data_empty(unsigned char id);
+/** Spin up to us microseconds for the data of the channel.
+ *
+ * The OUT_RING is drained by the caller if the poller is not on it. us could
+ * be 0 for a single pass. Return 0 if there is data, -EAGAIN on timeout.
+ */
+int rt_vbus_busy_poll(unsigned char id, unsigned int us);
+
+struct rt_vbus_rxmap;
+/** Let the channel receive into the mmaped area.
+ *
+ * Set map to NULL to go back to the data queue.
+ */
+void rt_vbus_set_rxmap(unsigned char chnr, struct rt_vbus_rxmap *map);
+/** Give back nr descriptors of the mmaped area of the channel.
+ *
+ * Return the number of descriptors consumed or negative error.
+ */
+int rt_vbus_rxmap_done(unsigned char chnr, unsigned int nr);
 
 void rt_vmm_clear_emuint(unsigned int nr);
 void rt_vmm_trigger_emuint(unsigned int irqnr);
@@ -68,5 +178,15 @@ int chn0_load(void);
 void chn0_unload(void);
 
 #define RT_VBUS_USING_FLOW_CONTROL
+/* Let rt_vbus_post write into the ring directly when it is not contended. */
+#define RT_VBUS_USING_DIRECT_POST
+/* Negotiate the event index to suppress the unneeded notifications. */
+#define RT_VBUS_USING_EVENT_IDX
+/* Pass the big messages in the bulk region instead of the ring. */
+#define RT_VBUS_USING_BULK
+/* Per-CPU counters of each channel in debugfs. */
+#define RT_VBUS_USING_STATS
+/* The AF_VBUS socket family over the channels. */
+#define RT_VBUS_USING_SOCKET
 
 #endif /* end of include guard: __LINUX_DRIVER_H__ */
@@ -82,6 +82,29 @@ static struct rt_prio_queue_item* _do_pop(struct rt_prio_queue *que)
 	return item;
 }
 
+/* Put the data into the slot taken from item_avaialble. */
+static int _do_insert(struct rt_prio_queue *que,
+		      unsigned char prio,
+		      char *data)
+{
+	struct rt_prio_queue_item *item;
+
+	item = kmem_cache_alloc(que->pool, GFP_KERNEL);
+	if (!item) {
+		atomic_inc(&que->item_avaialble);
+		return -ENOMEM;
+	}
+
+	item->next = NULL;
+	memcpy(item+1, data, que->item_sz);
+
+	_do_push(que, prio, item);
+
+	wake_up_interruptible(&que->pop_wait);
+
+	return 0;
+}
+
 struct rt_prio_queue* rt_prio_queue_create(const char *name,
 					   size_t item_nr,
                                            size_t item_sz)
@@ -138,7 +161,6 @@ int rt_prio_queue_push(struct rt_prio_queue *que,
 		       char *data)
 {
 	int res = 0;
-	struct rt_prio_queue_item *item;
 
 	if (atomic_dec_return(&que->item_avaialble) < 0) {
 		DEFINE_WAIT(__wait);
@@ -163,23 +185,27 @@ int rt_prio_queue_push(struct rt_prio_queue *que,
 		finish_wait(&que->push_wait, &__wait);
 	}
 
-	item = kmem_cache_alloc(que->pool, GFP_KERNEL);
-	if (!item) {
-		res = -ENOMEM;
-		goto Out;
-	}
-
-	item->next = NULL;
-	memcpy(item+1, data, que->item_sz);
-
-	_do_push(que, prio, item);
-
-	wake_up_interruptible(&que->pop_wait);
+	res = _do_insert(que, prio, data);
 
 Out:
 	return res;
 }
 
+/**
+ * return -EAGAIN if the queue is full.
+ */
+int rt_prio_queue_trypush(struct rt_prio_queue *que,
+			  unsigned char prio,
+			  char *data)
+{
+	if (atomic_dec_return(&que->item_avaialble) < 0) {
+		atomic_inc(&que->item_avaialble);
+		return -EAGAIN;
+	}
+
+	return _do_insert(que, prio, data);
+}
+
 int rt_prio_queue_pop(struct rt_prio_queue *que,
 		      char *data)
 {
@@ -54,6 +54,9 @@ void rt_prio_queue_delete(struct rt_prio_queue *que);
 int rt_prio_queue_push(struct rt_prio_queue *que,
 		       unsigned char prio,
 		       char *data);
+int rt_prio_queue_trypush(struct rt_prio_queue *que,
+			  unsigned char prio,
+			  char *data);
 int rt_prio_queue_pop(struct rt_prio_queue *que,
 		      char *data);
 int rt_prio_queue_trypop(struct rt_prio_queue *que,
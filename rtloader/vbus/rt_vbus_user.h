@@ -40,14 +40,115 @@ struct rt_vbus_request {
 	/* flags of the opened fd */
 	int oflag;
 	struct rt_vbus_wm_cfg recv_wm, post_wm;
+	/* Receive buffers pre-allocated for each size class, 0 for the
+	 * default. */
+	unsigned int rx_pool_nr;
+	/* Ring pair the channel goes on, below RT_VBUS_QUEUE_NR. Queue 0 is
+	 * used if the other side has only one. */
+	unsigned int queue;
+	/* RT_VBUS_REQ_xxx */
+	unsigned int flags;
 };
 
+/* One read(2) returns exactly one message. The fragments posted by the other
+ * side are put back together. The part of a message that doesn't fit in the
+ * buffer is dropped. The fd of such a channel can not be mmap(2)ed or
+ * spliced, they would see the fragments. */
+#define RT_VBUS_REQ_DGRAM  0x1
+
+/* The channel fd could be mmap(2)ed read-only to receive the data in place.
+ * The first page of the mapping is the header followed by the descriptors.
+ * The payloads are in the following pages. Once mapped, the new packets will
+ * go into the mapping instead of being returned by read(2). */
+struct rt_vbus_rxmap_desc {
+	/* Offset of the payload from the start of the mapping. */
+	unsigned int off;
+	unsigned int len;
+};
+
+struct rt_vbus_rxmap_hdr {
+	/* Free running indexes of the descriptors. The descriptors in [cons,
+	 * prod) are ready to be read. prod is moved by the kernel when the new
+	 * packet arrived. cons is moved by VBUS_IOCRXCONSUME. */
+	volatile unsigned int prod;
+	volatile unsigned int cons;
+	/* Number of descriptors following the header. */
+	unsigned int desc_nr;
+	/* Size of the whole mapping. */
+	unsigned int size;
+	/* struct rt_vbus_rxmap_desc desc[desc_nr] follows */
+};
+
+struct rt_vbus_msg {
+	const void *data;
+	size_t len;
+};
+
+/* Argument of VBUS_IOCPOSTV. */
+struct rt_vbus_msgv {
+	struct rt_vbus_msg *msgs;
+	unsigned int nr;
+};
+
+/* A message of VBUS_IOCRECVV. */
+struct rt_vbus_rmsg {
+	void *buf;
+	/* Size of buf. */
+	size_t size;
+	/* Set to the length of the message. It is bigger than size if the
+	 * message is truncated. */
+	size_t len;
+};
+
+/* Argument of VBUS_IOCRECVV. */
+struct rt_vbus_rmsgv {
+	struct rt_vbus_rmsg *msgs;
+	unsigned int nr;
+};
+
+/* Max number of messages in one VBUS_IOCPOSTV or VBUS_IOCRECVV. */
+#define RT_VBUS_MSGV_MAX   64
+
+/* Address of the AF_VBUS sockets. The family number is a parameter of the
+ * module and has no default. SOCK_STREAM and SOCK_SEQPACKET are supported,
+ * the latter is a RT_VBUS_REQ_DGRAM channel. The name is a NUL terminated
+ * channel name, shorter than RT_VBUS_CHN_NAME_MAX. */
+struct sockaddr_vbus {
+	unsigned short svbus_family;
+	char svbus_name[16];
+};
+
+/* Socket options of the AF_VBUS sockets. The level only reaches this family.
+ * VBUS_SO_ZEROCOPY is an int: when set, blocking sends of a single iovec are
+ * posted from the pinned user pages. */
+#define SOL_VBUS           0x1E1
+#define VBUS_SO_ZEROCOPY   1
+
+/* Max of rt_vbus_request.rx_pool_nr. */
+#define RT_VBUS_RX_POOL_MAX 1024
+
 /* find a spare magic in Documentation/ioctl/ioctl-number.txt */
 #define VBUS_IOC_MAGIC     0xE1
 #define VBUS_IOCREQ        _IOWR(VBUS_IOC_MAGIC, 0xE2, struct rt_vbus_request)
 /* Water marks can be controled on the fly. */
 #define VBUS_IOCRECV_WM    _IOWR(VBUS_IOC_MAGIC, 0xE3, struct rt_vbus_request)
 #define VBUS_IOCPOST_WM    _IOWR(VBUS_IOC_MAGIC, 0xE4, struct rt_vbus_request)
+/* Give back the oldest arg descriptors of the mmaped area. Return the number
+ * of descriptors consumed. */
+#define VBUS_IOCRXCONSUME  _IO(VBUS_IOC_MAGIC, 0xE5)
+/* Post an array of messages with one syscall. Return the number of messages
+ * posted. */
+#define VBUS_IOCPOSTV      _IOW(VBUS_IOC_MAGIC, 0xE6, struct rt_vbus_msgv)
+/* Like VBUS_IOCREQ but return a fd of the pending request right away. The fd
+ * polls readable once the request is settled, then VBUS_IOCREQ_FINISH on it
+ * returns the fd of the channel or the error. Closing the fd gives up the
+ * request. */
+#define VBUS_IOCREQ_ASYNC  _IOW(VBUS_IOC_MAGIC, 0xE7, struct rt_vbus_request)
+/* Return -EAGAIN if the request is still pending. */
+#define VBUS_IOCREQ_FINISH _IO(VBUS_IOC_MAGIC, 0xE8)
+/* Receive up to nr messages of a RT_VBUS_REQ_DGRAM channel. Only wait for the
+ * first one. Return the number of messages received. */
+#define VBUS_IOCRECVV      _IOW(VBUS_IOC_MAGIC, 0xE9, struct rt_vbus_rmsgv)
 
 /* keep consistent with beaglebone/components/vmm/share_hdr/rtt_api.h */
 #define RT_VBUS_SHELL_DEV_NAME "vbser0"
@@ -0,0 +1,135 @@
+/*
+ *  VMM Bus bulk buffers
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+/* The buffers are allocated from our half of the region by gen_pool. Each of
+ * them has a head keeping the size to free it. The other side manages its
+ * half by itself. */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/genalloc.h>
+
+#include <vbus_api.h>
+#include <vbus_layout.h>
+
+#include "linux_driver.h"
+#include "vbus_bulk.h"
+
+/* Page granular, and the data is cache line aligned after the head. */
+#define _BULK_ORDER     PAGE_SHIFT
+#define _BULK_HEAD_SZ   RT_VBUS_CACHE_LINE_SZ
+
+struct _bulk_head {
+	size_t size;
+};
+
+static char *_bulk_base;
+static size_t _bulk_sz;
+static struct gen_pool *_bulk_pool;
+
+int rt_vbus_bulk_init(void *base, size_t size)
+{
+	int res;
+
+	_bulk_pool = gen_pool_create(_BULK_ORDER, -1);
+	if (!_bulk_pool)
+		return -ENOMEM;
+
+	/* We allocate from the lower half. Its top keeps the post stamps. */
+	res = gen_pool_add(_bulk_pool, (unsigned long)base,
+			   size / 2 - _RT_VBUS_LAT_TBL_SZ, -1);
+	if (res) {
+		gen_pool_destroy(_bulk_pool);
+		_bulk_pool = NULL;
+		return res;
+	}
+
+	_bulk_base = base;
+	_bulk_sz   = size;
+
+	return 0;
+}
+
+void rt_vbus_bulk_deinit(void)
+{
+	if (!_bulk_pool)
+		return;
+
+	/* gen_pool_destroy does not like the buffers still in use. They are
+	 * lent to the other side, so just leave the pool there. */
+	if (gen_pool_avail(_bulk_pool) != gen_pool_size(_bulk_pool))
+		pr_err("VMM/Bus: bulk buffers not given back\n");
+	else
+		gen_pool_destroy(_bulk_pool);
+	_bulk_pool = NULL;
+}
+
+void* rt_vbus_bulk_alloc(size_t size)
+{
+	struct _bulk_head *h;
+
+	if (!_bulk_pool)
+		return NULL;
+
+	size += _BULK_HEAD_SZ;
+	h = (struct _bulk_head*)gen_pool_alloc(_bulk_pool, size);
+	if (!h)
+		return NULL;
+	h->size = size;
+
+	return (char*)h + _BULK_HEAD_SZ;
+}
+EXPORT_SYMBOL(rt_vbus_bulk_alloc);
+
+void rt_vbus_bulk_free(void *buf)
+{
+	struct _bulk_head *h = (struct _bulk_head*)((char*)buf - _BULK_HEAD_SZ);
+
+	gen_pool_free(_bulk_pool, (unsigned long)h, h->size);
+}
+EXPORT_SYMBOL(rt_vbus_bulk_free);
+
+unsigned int rt_vbus_bulk_off(const void *buf)
+{
+	return (const char*)buf - _bulk_base;
+}
+
+void* rt_vbus_bulk_local(unsigned int off)
+{
+	if (!_bulk_pool || off < _BULK_HEAD_SZ || off >= _bulk_sz / 2)
+		return NULL;
+	return _bulk_base + off;
+}
+
+void* rt_vbus_bulk_remote(unsigned int off, size_t len)
+{
+	if (!_bulk_pool || off < _bulk_sz / 2 || off > _bulk_sz ||
+	    len > _bulk_sz - off)
+		return NULL;
+	return _bulk_base + off;
+}
@@ -0,0 +1,49 @@
+/*
+ *  VMM Bus bulk buffers
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#ifndef __VBUS_BULK_H__
+#define __VBUS_BULK_H__
+
+/* Manage our half of the bulk region of size bytes at base. */
+int rt_vbus_bulk_init(void *base, size_t size);
+void rt_vbus_bulk_deinit(void);
+
+/* Offset of a buffer from the start of the region. */
+unsigned int rt_vbus_bulk_off(const void *buf);
+/** Our buffer at off given back by the other side.
+ *
+ * Return NULL if off is not in our half.
+ */
+void* rt_vbus_bulk_local(unsigned int off);
+/** Buffer of len bytes at off lent by the other side.
+ *
+ * Return NULL if it is not in the half of the other side.
+ */
+void* rt_vbus_bulk_remote(unsigned int off, size_t len);
+
+#endif /* end of include guard: __VBUS_BULK_H__ */
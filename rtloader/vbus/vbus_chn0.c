@@ -33,12 +33,16 @@
 #include <linux/module.h>
 #include <linux/ioctl.h>
 #include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/anon_inodes.h>
 #include <asm/uaccess.h>
 
 #include <vbus_api.h>
 
 #include "linux_driver.h"
 #include "vbus_chnx.h"
+#include "vbus_sock.h"
 
 static struct cdev _chn0_dev;
 static atomic_t _device_count = ATOMIC_INIT(1);
@@ -63,41 +67,173 @@ static int _release(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/* Copy the request from the user. The name is put into chname. */
+static int _get_req(struct rt_vbus_request *req, char *chname,
+		    unsigned long arg)
+{
+	int nlen, res;
+
+	if (copy_from_user(req, (struct rt_vbus_request*)arg,
+			   sizeof(*req)))
+		return -EFAULT;
+
+	nlen = strnlen_user(req->name, RT_VBUS_CHN_NAME_MAX);
+	res = copy_from_user(chname, req->name, nlen);
+	if (res < 0) {
+		return -EFAULT;
+	}
+	/* Let the name point to kernel space. */
+	req->name = chname;
+
+	if (req->recv_wm.low > req->recv_wm.high)
+		return -EINVAL;
+	if (req->post_wm.low > req->post_wm.high)
+		return -EINVAL;
+	if (req->rx_pool_nr > RT_VBUS_RX_POOL_MAX)
+		return -EINVAL;
+	return 0;
+}
+
+/* Request made by VBUS_IOCREQ_ASYNC, behind the pending fd. */
+struct _chn0_pending {
+	struct rt_vbus_request req;
+	char chname[RT_VBUS_CHN_NAME_MAX];
+	/* Handle of the request, -1 once it is finished. */
+	int handle;
+	int settled;
+	struct mutex lock;
+	wait_queue_head_t wait;
+};
+
+static void _pending_done(void *arg, int chnr)
+{
+	struct _chn0_pending *p = arg;
+
+	p->settled = 1;
+	wake_up_interruptible(&p->wait);
+}
+
+static unsigned int _pending_poll(struct file *filp, poll_table *wait)
+{
+	struct _chn0_pending *p = filp->private_data;
+
+	poll_wait(filp, &p->wait, wait);
+
+	if (ACCESS_ONCE(p->settled))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static long _pending_ioctl(struct file *filp, unsigned int cmd,
+			   unsigned long arg)
+{
+	int chnr, res;
+	struct _chn0_pending *p = filp->private_data;
+
+	if (cmd != VBUS_IOCREQ_FINISH)
+		return -ENOTTY;
+
+	mutex_lock(&p->lock);
+	if (p->handle < 0) {
+		mutex_unlock(&p->lock);
+		return -EINVAL;
+	}
+	chnr = rt_vbus_request_finish(p->handle);
+	if (chnr != -EAGAIN)
+		p->handle = -1;
+	mutex_unlock(&p->lock);
+
+	if (chnr < 0)
+		return chnr;
+
+	res = vbus_chnx_get_fd(chnr, p->req.prio, p->req.oflag,
+			       p->req.flags);
+	if (res < 0)
+		rt_vbus_close_chn(chnr);
+	return res;
+}
+
+static int _pending_release(struct inode *inode, struct file *filp)
+{
+	struct _chn0_pending *p = filp->private_data;
+
+	if (p->handle >= 0)
+		rt_vbus_request_cancel(p->handle);
+	kfree(p);
+	return 0;
+}
+
+static const struct file_operations _pending_ops = {
+	.owner          = THIS_MODULE,
+	.poll           = _pending_poll,
+	.unlocked_ioctl = _pending_ioctl,
+	.release        = _pending_release,
+};
+
+static long _req_async(unsigned long arg)
+{
+	int res;
+	struct _chn0_pending *p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return -ENOMEM;
+
+	res = _get_req(&p->req, p->chname, arg);
+	if (res)
+		goto _free;
+
+	mutex_init(&p->lock);
+	init_waitqueue_head(&p->wait);
+
+	p->handle = rt_vbus_request_chn_async(&p->req, !!p->req.is_server,
+					      vbus_chnx_callback,
+					      _pending_done, p);
+	if (p->handle < 0) {
+		res = p->handle;
+		goto _free;
+	}
+
+	res = anon_inode_getfd("[vbus_req]", &_pending_ops, p,
+			       O_RDONLY | (p->req.oflag & O_CLOEXEC));
+	if (res < 0) {
+		rt_vbus_request_cancel(p->handle);
+		goto _free;
+	}
+	return res;
+
+_free:
+	kfree(p);
+	return res;
+}
+
 static long _ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	int chnr, nlen;
+	int chnr;
 	char chname[RT_VBUS_CHN_NAME_MAX];
 	int res = -ENOTTY;
 	struct rt_vbus_request req;
 
 	switch (cmd) {
 	case VBUS_IOCREQ:
-		if (copy_from_user(&req, (struct rt_vbus_request*)arg,
-				   sizeof(req)))
-			return -EFAULT;
-
-		nlen = strnlen_user(req.name, sizeof(chname));
-		res = copy_from_user(chname, req.name, nlen);
-		if (res < 0) {
-			return -EFAULT;
-		}
-		/* Let the name point to kernel space. */
-		req.name = chname;
-
-		if (req.recv_wm.low > req.recv_wm.high)
-			return -EINVAL;
-		if (req.post_wm.low > req.post_wm.high)
-			return -EINVAL;
+		res = _get_req(&req, chname, arg);
+		if (res)
+			return res;
 		chnr = rt_vbus_request_chn(&req,
 					   !!req.is_server,
 					   vbus_chnx_callback);
 		if (chnr < 0)
 			return chnr;
-		res = vbus_chnx_get_fd(chnr, req.prio, req.oflag);
+		res = vbus_chnx_get_fd(chnr, req.prio, req.oflag,
+				       req.flags);
 		if (res < 0) {
 			rt_vbus_close_chn(chnr);
 			return res;
 		}
+		break;
+	case VBUS_IOCREQ_ASYNC:
+		res = _req_async(arg);
+		break;
 	default:
 		break;
 	};
@@ -148,11 +284,21 @@ int chn0_load(void)
 		}
 	}
 
-	return vbus_chnx_init();
+	res = vbus_chnx_init();
+	if (res)
+		return res;
+
+	/* The channel fds work without it. */
+	res = vbus_sock_init();
+	if (res)
+		pr_err("err registering the vbus sockets: %d\n", res);
+
+	return 0;
 }
 
 void chn0_unload(void)
 {
+	vbus_sock_exit();
 	unregister_chrdev_region(_chn0_dev.dev, 1);
 	cdev_del(&_chn0_dev);
 	if (_chn0_cls) {
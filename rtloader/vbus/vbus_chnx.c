@@ -38,56 +38,263 @@
 #include <linux/sched.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/completion.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/spinlock.h>
 #include <linux/anon_inodes.h>
+#include <linux/highmem.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
 
 #include <vbus_api.h>
 
 #include "linux_driver.h"
+#include "vbus_rxmap.h"
+#include "vbus_stats.h"
 
 struct vbus_chnx_ctx {
 	unsigned char prio;
+	/* Opened with RT_VBUS_REQ_DGRAM. */
+	int dgram;
+	/* The packet being read. The packets taken by splice but not yet
+	 * consumed are chained by the next field. */
 	struct rt_vbus_data *datap;
 	size_t pos;
 	int fd;
 	wait_queue_head_t wait;
+	/* Not NULL if the channel is mmaped. */
+	struct rt_vbus_rxmap *rxmap;
+	struct mutex rxmap_lock;
 };
 
 static struct vbus_chnx_ctx  _ctxs[RT_VBUS_CHANNEL_NR];
 
+/* Writes of at least this size go through the bulk buffers. */
+static unsigned int bulk_threshold = 64 * 1024;
+module_param(bulk_threshold, uint, 0644);
+MODULE_PARM_DESC(bulk_threshold, "bytes of a write to pass it by a bulk buffer instead of the ring");
+
+/* Writes of at least this size are posted from the pinned user pages. Mapping
+ * the pages costs more than copying the small ones. */
+static unsigned int pin_threshold = 16 * 1024;
+module_param(pin_threshold, uint, 0644);
+MODULE_PARM_DESC(pin_threshold, "bytes of a write to post it from the user pages without copying");
+
 static int vbus_chnx_open(struct inode *inode, struct file *filp)
 {
 	printk("chx: try to open inode %p, filp %p\n", inode, filp);
 	return 0;
 }
 
+void vbus_chnx_detach(unsigned char chnr)
+{
+	rt_vbus_close_chn(chnr);
+
+	while (_ctxs[chnr].datap) {
+		struct rt_vbus_data *next = _ctxs[chnr].datap->next;
+
+		rt_vbus_data_free(_ctxs[chnr].datap);
+		_ctxs[chnr].datap = next;
+	}
+
+	if (_ctxs[chnr].rxmap) {
+		rt_vbus_set_rxmap(chnr, NULL);
+		rt_vbus_rxmap_delete(_ctxs[chnr].rxmap);
+		_ctxs[chnr].rxmap = NULL;
+	}
+}
+
 static int vbus_chnx_release(struct inode *inode, struct file *filp)
 {
 	unsigned char chnr = (unsigned int)filp->private_data;
 
 	/*pr_info("chx: release chnr %d, fd %d\n", chnr, _ctxs[chnr].fd);*/
 
-	rt_vbus_close_chn(chnr);
+	vbus_chnx_detach(chnr);
 
 	return 0;
 }
 
-static ssize_t vbus_chnx_write(struct file *filp,
-			       const char __user *buf, size_t size,
-			       loff_t *offp)
+/* copy_to_iter and copy_from_iter come with 3.19. The iters we get are
+ * iovecs, so walk them by hand. Return the bytes copied, short on fault. */
+static size_t _chnx_copy_iter(void *buf, size_t bytes, struct iov_iter *i,
+			      int to_user)
+{
+	const struct iovec *iov = i->iov;
+	size_t skip = i->iov_offset;
+	size_t done = 0;
+
+	bytes = min(bytes, iov_iter_count(i));
+	while (done < bytes) {
+		size_t n = min(bytes - done, iov->iov_len - skip);
+		unsigned long left;
+
+		if (to_user)
+			left = copy_to_user(iov->iov_base + skip,
+					    (char*)buf + done, n);
+		else
+			left = copy_from_user((char*)buf + done,
+					      iov->iov_base + skip, n);
+		done += n - left;
+		if (left)
+			break;
+		iov++;
+		skip = 0;
+	}
+
+	iov_iter_advance(i, done);
+	return done;
+}
+
+static size_t _chnx_copy_from_iter(void *to, size_t bytes,
+				   struct iov_iter *from)
+{
+	return _chnx_copy_iter(to, bytes, from, 0);
+}
+
+static size_t _chnx_copy_to_iter(const void *from, size_t bytes,
+				 struct iov_iter *to)
+{
+	return _chnx_copy_iter((void *)from, bytes, to, 1);
+}
+
+/* Copy the data into a bulk buffer and lend it to the other side. Return
+ * -ENOMEM if there is no buffer so the caller could fall back to the ring. */
+static ssize_t _chnx_write_bulk(unsigned long chnr,
+				struct iov_iter *from, size_t size)
+{
+	int res;
+	void *bbuf = rt_vbus_bulk_alloc(size);
+
+	if (!bbuf)
+		return -ENOMEM;
+
+	if (_chnx_copy_from_iter(bbuf, size, from) != size) {
+		rt_vbus_bulk_free(bbuf);
+		return -EFAULT;
+	}
+
+	res = rt_vbus_post_bulk(chnr, _ctxs[chnr].prio, bbuf, size);
+	if (res) {
+		rt_vbus_bulk_free(bbuf);
+		return res < 0 ? res : -res;
+	}
+	return size;
+}
+
+struct _chnx_post_wait {
+	struct completion cmp;
+	int res;
+};
+
+static void _chnx_post_done(void *arg, int res)
+{
+	struct _chnx_post_wait *w = arg;
+
+	w->res = res;
+	complete(&w->cmp);
+}
+
+/* Map the user buffer into the kernel and post it from there, so the data is
+ * copied only once into the ring. */
+static ssize_t _chnx_write_pinned(unsigned long chnr,
+				  const char __user *buf, size_t size)
+{
+	unsigned long start = (unsigned long)buf;
+	unsigned int off = offset_in_page(start);
+	int i, nr = DIV_ROUND_UP(off + size, PAGE_SIZE);
+	int pinned = 0;
+	struct page **pages;
+	struct _chnx_post_wait w;
+	char *kaddr;
+	ssize_t res;
+
+	pages = kmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	pinned = get_user_pages_fast(start & PAGE_MASK, nr, 0, pages);
+	if (pinned < nr) {
+		res = -EFAULT;
+		goto out_put;
+	}
+
+	kaddr = vm_map_ram(pages, nr, -1, PAGE_KERNEL);
+	if (!kaddr) {
+		res = -ENOMEM;
+		goto out_put;
+	}
+
+	init_completion(&w.cmp);
+	res = rt_vbus_post_async(chnr, _ctxs[chnr].prio, kaddr + off, size, 0,
+				 _chnx_post_done, &w);
+	if (res == 0) {
+		/* The worker reads the pages, don't give them back before it
+		 * is done even on signals. */
+		wait_for_completion(&w.cmp);
+		res = w.res;
+	}
+	vm_unmap_ram(kaddr, nr);
+
+out_put:
+	for (i = 0; i < pinned; i++)
+		put_page(pages[i]);
+	kfree(pages);
+
+	if (res)
+		return res < 0 ? res : -res;
+	return size;
+}
+
+static void _chnx_kfree_done(void *arg, int res)
+{
+	kfree(arg);
+}
+
+/* Hand a copy of the data to VBUS and return without waiting. */
+static ssize_t _chnx_write_nonblock(unsigned long chnr,
+				    struct iov_iter *from, size_t size)
 {
 	int res;
-	unsigned long chnr = (unsigned long)(filp->private_data);
 	char *kbuf = kmalloc(size, GFP_KERNEL);
 
 	if (!kbuf)
 		return -ENOMEM;
 
-	res = copy_from_user(kbuf, buf, size);
-	if (res < 0)
+	if (_chnx_copy_from_iter(kbuf, size, from) != size) {
+		kfree(kbuf);
+		return -EFAULT;
+	}
+
+	res = rt_vbus_post_async(chnr, _ctxs[chnr].prio, kbuf, size,
+				 RT_VBUS_POST_NONBLOCK, _chnx_kfree_done, kbuf);
+	if (res) {
+		kfree(kbuf);
+		return res < 0 ? res : -res;
+	}
+	return size;
+}
+
+/* Copy the data into a kernel buffer and post it from there. */
+static ssize_t _chnx_write_copy(unsigned long chnr,
+				struct iov_iter *from, size_t size)
+{
+	int res;
+	char *kbuf;
+
+	kbuf = kmalloc(size, GFP_KERNEL);
+
+	if (!kbuf)
+		return -ENOMEM;
+
+	if (_chnx_copy_from_iter(kbuf, size, from) != size) {
+		kfree(kbuf);
 		return -EFAULT;
+	}
 
 	res = rt_vbus_post(chnr, _ctxs[chnr].prio, kbuf, size);
 
@@ -104,100 +311,555 @@ static ssize_t vbus_chnx_write(struct file *filp,
 		return size;
 }
 
-static ssize_t vbus_chnx_read(struct file *filp,
-			      char __user *buf, size_t size,
-			      loff_t *offp)
+static ssize_t _chnx_write_iter(unsigned long chnr,
+				struct iov_iter *from, int nonblock)
+{
+	size_t size = iov_iter_count(from);
+
+	/* The bulk writes wait for the other side. */
+	if (nonblock)
+		return _chnx_write_nonblock(chnr, from, size);
+
+	if (size >= bulk_threshold && rt_vbus_bulk_supported()) {
+		ssize_t wsz = _chnx_write_bulk(chnr, from, size);
+
+		if (wsz != -ENOMEM)
+			return wsz;
+	}
+
+	return _chnx_write_copy(chnr, from, size);
+}
+
+ssize_t vbus_chnx_send(unsigned char chnr, struct iov_iter *from, int nonblock)
+{
+	return _chnx_write_iter(chnr, from, nonblock);
+}
+
+ssize_t vbus_chnx_send_pinned(unsigned char chnr,
+			      const char __user *buf, size_t size)
+{
+	return _chnx_write_pinned(chnr, buf, size);
+}
+
+static ssize_t vbus_chnx_write(struct file *filp,
+			       const char __user *buf, size_t size,
+			       loff_t *offp)
+{
+	unsigned long chnr = (unsigned long)(filp->private_data);
+	int nonblock = filp->f_flags & O_NONBLOCK;
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = size };
+	struct iov_iter from;
+
+	if (!nonblock && size >= pin_threshold &&
+	    (size < bulk_threshold || !rt_vbus_bulk_supported()))
+		return _chnx_write_pinned(chnr, buf, size);
+
+	iov_iter_init(&from, WRITE, &iov, 1, size);
+	return _chnx_write_iter(chnr, &from, nonblock);
+}
+
+static ssize_t vbus_chnx_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	unsigned long chnr = (unsigned long)(filp->private_data);
+
+	return _chnx_write_iter(chnr, from, filp->f_flags & O_NONBLOCK);
+}
+
+/* Pop the next packet of the channel, NULL if there is none. */
+static struct rt_vbus_data* _chnx_pop(unsigned long chnr)
+{
+	struct rt_vbus_data *dat = rt_vbus_data_pop(chnr);
+
+	if (IS_ERR_OR_NULL(dat))
+		return NULL;
+	dat->next = NULL;
+	return dat;
+}
+
+/* Free the packet that has been read through and move to the next one. */
+static void _chnx_next(struct vbus_chnx_ctx *ctx, unsigned long chnr)
+{
+	struct rt_vbus_data *next = ctx->datap->next;
+
+	rt_vbus_data_free(ctx->datap);
+	ctx->datap = next ? next : _chnx_pop(chnr);
+	ctx->pos   = 0;
+}
+
+/* Make ctx->datap the packet to read from. Return 1 if there is one, 0 if the
+ * connection is gone or negative error. */
+static int _chnx_get_data(unsigned long chnr, int nonblock)
 {
-	unsigned long chnr = (unsigned long)filp->private_data;
 	struct vbus_chnx_ctx *ctx = &_ctxs[chnr];
-	size_t outsz = 0;
+	int err;
 
 	if (ctx->datap == NULL) {
-		ctx->datap = rt_vbus_data_pop(chnr);
+		ctx->datap = _chnx_pop(chnr);
 		ctx->pos   = 0;
 	}
 	else if (ctx->pos == ctx->datap->size) {
-		kfree(ctx->datap);
-		ctx->datap = rt_vbus_data_pop(chnr);
-		ctx->pos   = 0;
+		_chnx_next(ctx, chnr);
 	}
 
-	if (ctx->datap == NULL) {
-		int err;
+	if (ctx->datap)
+		return 1;
 
-		if (!rt_vbus_connection_ok(chnr))
-			return 0;
+	if (!rt_vbus_connection_ok(chnr))
+		return 0;
 
-		if (filp->f_flags & O_NONBLOCK)
-			return -EAGAIN;
+	if (nonblock)
+		return -EAGAIN;
 
-		err = wait_event_interruptible(_ctxs[chnr].wait,
-					       !rt_vbus_data_empty(chnr) ||
-					       !rt_vbus_connection_ok(chnr));
-		if (err)
-			return err;
+	err = wait_event_interruptible(ctx->wait,
+				       !rt_vbus_data_empty(chnr) ||
+				       !rt_vbus_connection_ok(chnr));
+	if (err)
+		return err;
 
-		ctx->datap = rt_vbus_data_pop(chnr);
-		if (ctx->datap == NULL) {
-			return 0;
-		}
-		ctx->pos = 0;
-	}
+	ctx->datap = _chnx_pop(chnr);
+	return ctx->datap != NULL;
+}
 
-	if (IS_ERR(ctx->datap)) {
-		ssize_t err = PTR_ERR(ctx->datap);
-		/* Cleanup datap so we don't crash if we access it again. */
-		ctx->datap = NULL;
-		return err;
-	}
+/* Read one message of a datagram channel into to and drop what doesn't fit.
+ * Its length is returned in *len. Return 1 if a message is read, 0 if the
+ * connection is gone or negative error.
+ *
+ * The driver queues the fragments of a message all at once, so the whole
+ * message is there once the first fragment is. */
+static int _chnx_read_msg(unsigned long chnr, struct iov_iter *to,
+			  int nonblock, size_t *len)
+{
+	struct vbus_chnx_ctx *ctx = &_ctxs[chnr];
+	int res, more;
+
+	res = _chnx_get_data(chnr, nonblock);
+	if (res <= 0)
+		return res;
+
+	*len = 0;
+	do {
+		struct rt_vbus_data *dat = ctx->datap;
+		size_t sz = dat->size - ctx->pos;
+		size_t cpysz = min_t(size_t, sz, iov_iter_count(to));
+
+		if (_chnx_copy_to_iter((char*)rt_vbus_data_buf(dat) + ctx->pos,
+				       cpysz, to) != cpysz)
+			res = -EFAULT;
+		*len += sz;
+
+		more = dat->more;
+		if (!more)
+			rt_vbus_lat_account(chnr, RT_VBUS_LAT_DRAIN_READ,
+					    dat->ts);
+		_chnx_next(ctx, chnr);
+	} while (more && ctx->datap);
+
+	return res;
+}
+
+static ssize_t _chnx_read_iter(unsigned long chnr,
+			       struct iov_iter *to, int nonblock)
+{
+	struct vbus_chnx_ctx *ctx = &_ctxs[chnr];
+	size_t size = iov_iter_count(to);
+	size_t outsz = 0;
+	int res;
+
+	res = _chnx_get_data(chnr, nonblock);
+	if (res <= 0)
+		return res;
 
 	while (ctx->datap) {
-		size_t cpysz;
+		size_t cpysz, copied;
 
 		if (size - outsz > ctx->datap->size - ctx->pos)
 			cpysz = ctx->datap->size - ctx->pos;
 		else
 			cpysz = size - outsz;
 
-		if (copy_to_user(buf + outsz,
-				 ((char*)(ctx->datap+1)) + ctx->pos,
-				 cpysz))
-			return -EFAULT;
-		ctx->pos += cpysz;
+		copied = _chnx_copy_to_iter((char*)rt_vbus_data_buf(ctx->datap) + ctx->pos,
+					    cpysz, to);
+		ctx->pos += copied;
+		outsz    += copied;
+		if (copied != cpysz)
+			return outsz ? outsz : -EFAULT;
+		if (ctx->pos == ctx->datap->size)
+			rt_vbus_lat_account(chnr, RT_VBUS_LAT_DRAIN_READ,
+					    ctx->datap->ts);
 
-		outsz += cpysz;
 		if (outsz == size) {
 			return outsz;
 		}
 		BUG_ON(outsz > size);
 
 		/* Free the old, get the new. */
-		kfree(ctx->datap);
-		ctx->datap = rt_vbus_data_pop(chnr);
-		if (IS_ERR(ctx->datap)) {
-			ctx->datap = NULL;
-		}
-		ctx->pos   = 0;
-		/*pr_info("get other data %p, %d copied\n", ctx->datap, outsz);*/
+		_chnx_next(ctx, chnr);
 	}
 	return outsz;
 }
 
-static unsigned int vbus_chnx_poll(struct file *filp, poll_table *wait)
+ssize_t vbus_chnx_recv(unsigned char chnr, struct iov_iter *to, int nonblock,
+		       size_t *msglen)
+{
+	size_t size = iov_iter_count(to);
+	ssize_t res;
+
+	if (!_ctxs[chnr].dgram) {
+		res = _chnx_read_iter(chnr, to, nonblock);
+		*msglen = res > 0 ? res : 0;
+		return res;
+	}
+
+	res = _chnx_read_msg(chnr, to, nonblock, msglen);
+	if (res <= 0)
+		return res;
+	return min(*msglen, size);
+}
+
+static ssize_t vbus_chnx_read(struct file *filp,
+			      char __user *buf, size_t size,
+			      loff_t *offp)
 {
-	unsigned int mask = 0;
 	unsigned long chnr = (unsigned long)filp->private_data;
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct iov_iter to;
+	size_t len;
+
+	iov_iter_init(&to, READ, &iov, 1, size);
+	return vbus_chnx_recv(chnr, &to, filp->f_flags & O_NONBLOCK, &len);
+}
+
+static ssize_t vbus_chnx_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	unsigned long chnr = (unsigned long)filp->private_data;
+	size_t len;
+
+	return vbus_chnx_recv(chnr, to, filp->f_flags & O_NONBLOCK, &len);
+}
+
+/* Move the read position n bytes forward. The bytes are in the chain. */
+static void _chnx_consume(struct vbus_chnx_ctx *ctx, unsigned long chnr,
+			  size_t n)
+{
+	while (n) {
+		size_t sz = min_t(size_t, n, ctx->datap->size - ctx->pos);
+
+		ctx->pos += sz;
+		n        -= sz;
+		if (ctx->pos == ctx->datap->size) {
+			rt_vbus_lat_account(chnr, RT_VBUS_LAT_DRAIN_READ,
+					    ctx->datap->ts);
+			if (n)
+				_chnx_next(ctx, chnr);
+		}
+	}
+}
+
+static const struct pipe_buf_operations _chnx_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm   = generic_pipe_buf_confirm,
+	.release   = generic_pipe_buf_release,
+	.steal     = generic_pipe_buf_steal,
+	.get       = generic_pipe_buf_get,
+};
+
+static void _chnx_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/* Copy the packets into the pages of the pipe. Only the bytes the pipe takes
+ * are consumed, the rest is left for the next read. The pipe does not keep
+ * the message bounds, so there is none for RT_VBUS_REQ_DGRAM channels. */
+static ssize_t vbus_chnx_splice_read(struct file *filp, loff_t *ppos,
+				     struct pipe_inode_info *pipe,
+				     size_t len, unsigned int flags)
+{
+	unsigned long chnr = (unsigned long)filp->private_data;
+	struct vbus_chnx_ctx *ctx = &_ctxs[chnr];
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages        = pages,
+		.partial      = partial,
+		.nr_pages     = 0,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags        = flags,
+		.ops          = &_chnx_pipe_buf_ops,
+		.spd_release  = _chnx_spd_release,
+	};
+	struct rt_vbus_data *dat;
+	size_t pos, total = 0;
+	ssize_t res;
+	int more = 1;
+
+	if (ctx->dgram)
+		return -EINVAL;
+
+	res = _chnx_get_data(chnr, (filp->f_flags & O_NONBLOCK) ||
+				   (flags & SPLICE_F_NONBLOCK));
+	if (res <= 0)
+		return res;
+
+	dat = ctx->datap;
+	pos = ctx->pos;
+	while (more && spd.nr_pages < PIPE_DEF_BUFFERS && total < len) {
+		struct page *page = alloc_page(GFP_KERNEL);
+		unsigned int off = 0;
+		char *va;
+
+		if (!page) {
+			res = -ENOMEM;
+			break;
+		}
+		va = page_address(page);
+
+		/* Fill the page with as many packets as we have, don't wait
+		 * for more. */
+		while (off < PAGE_SIZE && total < len) {
+			size_t cpysz;
+
+			if (pos == dat->size) {
+				if (!dat->next)
+					dat->next = _chnx_pop(chnr);
+				if (!dat->next) {
+					more = 0;
+					break;
+				}
+				dat = dat->next;
+				pos = 0;
+				continue;
+			}
+
+			cpysz = min_t(size_t, PAGE_SIZE - off, dat->size - pos);
+			cpysz = min_t(size_t, cpysz, len - total);
+			memcpy(va + off, (char*)rt_vbus_data_buf(dat) + pos, cpysz);
+			off   += cpysz;
+			pos   += cpysz;
+			total += cpysz;
+		}
+
+		if (off == 0) {
+			__free_page(page);
+			break;
+		}
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len    = off;
+		spd.nr_pages++;
+	}
+
+	if (spd.nr_pages == 0)
+		return res < 0 ? res : 0;
+
+	res = splice_to_pipe(pipe, &spd);
+	if (res > 0)
+		_chnx_consume(ctx, chnr, res);
+	return res;
+}
+
+/* Each buffer of the pipe goes out as one message. */
+static int _chnx_pipe_to_vbus(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf,
+			      struct splice_desc *sd)
+{
+	unsigned long chnr = (unsigned long)sd->u.file->private_data;
+	char *va;
+	int res;
+
+	res = buf->ops->confirm(pipe, buf);
+	if (res)
+		return res;
+
+	va = kmap(buf->page);
+	res = rt_vbus_post(chnr, _ctxs[chnr].prio, va + buf->offset, sd->len);
+	kunmap(buf->page);
+	if (res)
+		return res < 0 ? res : -res;
+	return sd->len;
+}
+
+static ssize_t vbus_chnx_splice_write(struct pipe_inode_info *pipe,
+				      struct file *filp, loff_t *ppos,
+				      size_t len, unsigned int flags)
+{
+	return splice_from_pipe(pipe, filp, ppos, len, flags,
+				_chnx_pipe_to_vbus);
+}
+
+int vbus_chnx_readable(unsigned char chnr)
+{
+	return _ctxs[chnr].datap != NULL || !rt_vbus_data_empty(chnr);
+}
+
+unsigned int vbus_chnx_poll_chn(unsigned char chnr, struct file *filp,
+				poll_table *wait)
+{
+	unsigned int mask = 0;
 
 	poll_wait(filp, &_ctxs[chnr].wait, wait);
 
-	if (_ctxs[chnr].datap != NULL || !rt_vbus_data_empty(chnr))
+	if (vbus_chnx_readable(chnr))
+		mask |= POLLIN | POLLRDNORM;
+	if (_ctxs[chnr].rxmap && !rt_vbus_rxmap_empty(_ctxs[chnr].rxmap))
 		mask |= POLLIN | POLLRDNORM;
 	if (!rt_vbus_connection_ok(chnr))
 		mask |= POLLHUP;
+	else
+		mask |= rt_vbus_post_poll(chnr, filp, wait);
 
 	return mask;
 }
 
+static unsigned int vbus_chnx_poll(struct file *filp, poll_table *wait)
+{
+	unsigned long chnr = (unsigned long)filp->private_data;
+
+	return vbus_chnx_poll_chn(chnr, filp, wait);
+}
+
+/* Bound of the kernel buffer of VBUS_IOCPOSTV. */
+#define CHNX_POSTV_BUF_MAX  (32 * 1024)
+
+/* Copy the messages into a kernel buffer and post them in batches of the
+ * buffer size. A message bigger than the buffer is written alone. */
+static long vbus_chnx_postv(unsigned long chnr, struct rt_vbus_msgv *umv)
+{
+	int i, j, res, posted = 0;
+	size_t total = 0, fill;
+	char *kbuf;
+	struct rt_vbus_msgv mv;
+	struct rt_vbus_msg *msgs;
+
+	if (copy_from_user(&mv, umv, sizeof(mv)))
+		return -EFAULT;
+
+	if (mv.nr == 0)
+		return 0;
+	if (mv.nr > RT_VBUS_MSGV_MAX)
+		return -EINVAL;
+
+	msgs = kmalloc(mv.nr * sizeof(*msgs), GFP_KERNEL);
+	if (!msgs)
+		return -ENOMEM;
+
+	if (copy_from_user(msgs, mv.msgs, mv.nr * sizeof(*msgs))) {
+		res = -EFAULT;
+		goto _free_msgs;
+	}
+
+	for (i = 0; i < mv.nr && total < CHNX_POSTV_BUF_MAX; i++)
+		total += min_t(size_t, msgs[i].len, CHNX_POSTV_BUF_MAX);
+	total = min_t(size_t, total, CHNX_POSTV_BUF_MAX);
+
+	kbuf = kmalloc(total, GFP_KERNEL);
+	if (!kbuf) {
+		res = -ENOMEM;
+		goto _free_msgs;
+	}
+
+	res = 0;
+	for (i = 0; i < mv.nr; i = j) {
+		if (msgs[i].len > CHNX_POSTV_BUF_MAX) {
+			struct iovec iov = {
+				.iov_base = (void __user *)msgs[i].data,
+				.iov_len  = msgs[i].len,
+			};
+			struct iov_iter from;
+			ssize_t wsz;
+
+			iov_iter_init(&from, WRITE, &iov, 1, iov.iov_len);
+			wsz = _chnx_write_iter(chnr, &from, 0);
+			if (wsz < 0) {
+				res = wsz;
+				break;
+			}
+			posted++;
+			j = i + 1;
+			continue;
+		}
+
+		for (j = i, fill = 0;
+		     j < mv.nr && fill + msgs[j].len <= total; j++) {
+			if (copy_from_user(kbuf + fill, msgs[j].data,
+					   msgs[j].len)) {
+				res = -EFAULT;
+				break;
+			}
+			/* Let the data point to kernel space. */
+			msgs[j].data = kbuf + fill;
+			fill += msgs[j].len;
+		}
+		if (res)
+			break;
+
+		res = rt_vbus_post_batch(chnr, _ctxs[chnr].prio,
+					 msgs + i, j - i);
+		if (res < 0)
+			break;
+		posted += res;
+		if (res < j - i) {
+			res = -EIO;
+			break;
+		}
+		res = 0;
+	}
+
+	/* Report the messages posted before the error. */
+	if (posted > 0)
+		res = posted;
+
+	kfree(kbuf);
+_free_msgs:
+	kfree(msgs);
+	return res;
+}
+
+/* Receive the messages one by one. Stop at the first one that is not there
+ * yet, except for the first message. */
+static long vbus_chnx_recvv(struct file *filp, unsigned long chnr,
+			    struct rt_vbus_rmsgv __user *umv)
+{
+	struct rt_vbus_rmsgv mv;
+	unsigned int i;
+
+	if (!_ctxs[chnr].dgram)
+		return -EINVAL;
+
+	if (copy_from_user(&mv, umv, sizeof(mv)))
+		return -EFAULT;
+
+	if (mv.nr == 0 || mv.nr > RT_VBUS_MSGV_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < mv.nr; i++) {
+		struct rt_vbus_rmsg m;
+		struct iovec iov;
+		struct iov_iter to;
+		size_t len;
+		int res;
+
+		if (copy_from_user(&m, &mv.msgs[i], sizeof(m)))
+			return i ? i : -EFAULT;
+
+		iov.iov_base = m.buf;
+		iov.iov_len  = m.size;
+		iov_iter_init(&to, READ, &iov, 1, m.size);
+
+		res = _chnx_read_msg(chnr, &to,
+				     i || (filp->f_flags & O_NONBLOCK), &len);
+		if (res <= 0)
+			return i ? i : res;
+
+		if (put_user(len, &mv.msgs[i].len))
+			return -EFAULT;
+	}
+
+	return i;
+}
+
 static long vbus_chnx_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int res = -ENOTTY;
@@ -229,21 +891,76 @@ static long vbus_chnx_ioctl(struct file *filp, unsigned int cmd, unsigned long a
 	}
 		break;
 #endif
+	case VBUS_IOCPOSTV: {
+		unsigned long chnr = (unsigned long)filp->private_data;
+
+		return vbus_chnx_postv(chnr, (struct rt_vbus_msgv*)arg);
+	}
+		break;
+	case VBUS_IOCRECVV: {
+		unsigned long chnr = (unsigned long)filp->private_data;
+
+		return vbus_chnx_recvv(filp, chnr, (struct rt_vbus_rmsgv*)arg);
+	}
+		break;
+	case VBUS_IOCRXCONSUME: {
+		unsigned long chnr = (unsigned long)filp->private_data;
+
+		return rt_vbus_rxmap_done(chnr, arg);
+	}
+		break;
 	default:
 		break;
 	};
 	return res;
 }
 
+/* Map the receive area of the channel. The area is created on the first
+ * mmap and the size of it is the size of the mapping. The area takes the
+ * packets as they come, so RT_VBUS_REQ_DGRAM channels can not have it. */
+static int vbus_chnx_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int res;
+	unsigned long chnr = (unsigned long)filp->private_data;
+	struct vbus_chnx_ctx *ctx = &_ctxs[chnr];
+
+	if (ctx->dgram)
+		return -EINVAL;
+
+	mutex_lock(&ctx->rxmap_lock);
+	if (!ctx->rxmap) {
+		struct rt_vbus_rxmap *map;
+
+		map = rt_vbus_rxmap_create(vma->vm_end - vma->vm_start);
+		if (IS_ERR(map)) {
+			res = PTR_ERR(map);
+			goto _out;
+		}
+		ctx->rxmap = map;
+		rt_vbus_set_rxmap(chnr, map);
+	}
+
+	res = rt_vbus_rxmap_mmap(ctx->rxmap, vma);
+_out:
+	mutex_unlock(&ctx->rxmap_lock);
+
+	return res;
+}
+
 static const struct file_operations vbus_chnx_fops = {
 	.owner          = THIS_MODULE,
 	.open           = vbus_chnx_open,
 	.release        = vbus_chnx_release,
 	.read           = vbus_chnx_read,
 	.write          = vbus_chnx_write,
+	.read_iter      = vbus_chnx_read_iter,
+	.write_iter     = vbus_chnx_write_iter,
 	.llseek         = noop_llseek,
 	.poll           = vbus_chnx_poll,
 	.unlocked_ioctl = vbus_chnx_ioctl,
+	.mmap           = vbus_chnx_mmap,
+	.splice_read    = vbus_chnx_splice_read,
+	.splice_write   = vbus_chnx_splice_write,
 };
 
 int vbus_chnx_init(void)
@@ -252,30 +969,39 @@ int vbus_chnx_init(void)
 
 	for (i = 0; i < ARRAY_SIZE(_ctxs); i++) {
 		init_waitqueue_head(&_ctxs[i].wait);
+		mutex_init(&_ctxs[i].rxmap_lock);
 	}
 	return 0;
 }
 
+void vbus_chnx_attach(unsigned char chnr, unsigned char prio,
+		      unsigned int flags)
+{
+	if (prio == 0)
+		prio = 1;
+	_ctxs[chnr].prio  = prio;
+	_ctxs[chnr].dgram = !!(flags & RT_VBUS_REQ_DGRAM);
+	_ctxs[chnr].datap = NULL;
+	_ctxs[chnr].pos   = 0;
+	_ctxs[chnr].rxmap = NULL;
+}
+
 /* get a file descriptor corresponding to the channel
  */
 int vbus_chnx_get_fd(unsigned char chnr,
 		     unsigned char prio,
-		     int oflag)
+		     int oflag,
+		     unsigned int flags)
 {
 	/* supress compiler waring: cast to pointer from integer of different
 	 * size */
 	unsigned long lchnr = chnr;
-	int fd = anon_inode_getfd("[vbus_chnx]", &vbus_chnx_fops,
-				  (void*)lchnr, oflag);
-	if (fd > 0) {
-		if (prio == 0)
-			prio = 1;
-		else if (prio > 255)
-			prio = 255;
-		_ctxs[chnr].prio  = prio;
-		_ctxs[chnr].datap = NULL;
-		_ctxs[chnr].pos   = 0;
-	}
+	int fd;
+
+	/* The fd could be used as soon as it is installed. */
+	vbus_chnx_attach(chnr, prio, flags);
+	fd = anon_inode_getfd("[vbus_chnx]", &vbus_chnx_fops,
+			      (void*)lchnr, oflag);
 	_ctxs[chnr].fd = fd;
 
 	pr_info("get fd: %d, prio: %d\n", fd, prio);
@@ -29,11 +29,34 @@
 #ifndef __VBUS_CHNX_H__
 #define __VBUS_CHNX_H__
 
+struct file;
+struct iov_iter;
+struct poll_table_struct;
+
 int vbus_chnx_init(void);
 int vbus_chnx_get_fd(unsigned char chnr,
 		     unsigned char prio,
-		     int oflag);
+		     int oflag,
+		     unsigned int flags);
 
 void vbus_chnx_callback(unsigned char);
 
+/* The channels of the AF_VBUS sockets share the contexts with the fds. The
+ * socket should register vbus_chnx_callback as the channel callback. */
+void vbus_chnx_attach(unsigned char chnr, unsigned char prio,
+		      unsigned int flags);
+/* Close the channel and free what is left in the context. */
+void vbus_chnx_detach(unsigned char chnr);
+/* *msglen is the length of the whole message in RT_VBUS_REQ_DGRAM mode. */
+ssize_t vbus_chnx_recv(unsigned char chnr, struct iov_iter *to, int nonblock,
+		       size_t *msglen);
+ssize_t vbus_chnx_send(unsigned char chnr, struct iov_iter *from, int nonblock);
+/* Post from the user pages without copying. It always waits. */
+ssize_t vbus_chnx_send_pinned(unsigned char chnr,
+			      const char __user *buf, size_t size);
+/* Whether the data queue of the channel has anything to read. */
+int vbus_chnx_readable(unsigned char chnr);
+unsigned int vbus_chnx_poll_chn(unsigned char chnr, struct file *filp,
+				struct poll_table_struct *wait);
+
 #endif /* end of include guard: __VBUS_CHNX_H__ */
@@ -0,0 +1,177 @@
+/*
+ *  VMM Bus receive buffer pool
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+/* Receive buffers recycled by the channel instead of going back to the slab
+ * on every packet. Each size class keeps up to nr free buffers. */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include <vbus_api.h>
+#include <vbus_layout.h>
+
+#include "linux_driver.h"
+#include "vbus_pool.h"
+
+/* Data size of the classes. The last one holds the biggest packet. */
+static const unsigned int _cls_sz[] = {64, 256, 1024, RT_VBUS_V3_MAX_PKT_SZ};
+#define _CLS_NR     ARRAY_SIZE(_cls_sz)
+
+struct rt_vbus_pool {
+	spinlock_t lock;
+	struct rt_vbus_data *free[_CLS_NR];
+	unsigned int free_nr[_CLS_NR];
+	unsigned int nr;
+	/* Buffers out of the free lists. */
+	unsigned int used;
+	int dead;
+};
+
+static struct rt_vbus_data* _buf_alloc(struct rt_vbus_pool *pool,
+				       unsigned int cls, gfp_t gfp)
+{
+	struct rt_vbus_data *dat;
+
+	dat = kmalloc(sizeof(*dat) + _cls_sz[cls], gfp);
+	if (!dat)
+		return NULL;
+	dat->pool = pool;
+	dat->cls  = cls;
+	return dat;
+}
+
+struct rt_vbus_pool* rt_vbus_pool_create(unsigned int nr)
+{
+	int cls, i;
+	struct rt_vbus_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	spin_lock_init(&pool->lock);
+	pool->nr = nr;
+
+	for (cls = 0; cls < _CLS_NR; cls++) {
+		for (i = 0; i < nr; i++) {
+			struct rt_vbus_data *dat;
+
+			dat = _buf_alloc(pool, cls, GFP_KERNEL);
+			if (!dat) {
+				rt_vbus_pool_delete(pool);
+				return NULL;
+			}
+			dat->next = pool->free[cls];
+			pool->free[cls] = dat;
+			pool->free_nr[cls]++;
+		}
+	}
+
+	return pool;
+}
+
+void rt_vbus_pool_delete(struct rt_vbus_pool *pool)
+{
+	int cls, used;
+	struct rt_vbus_data *dat, *ndat;
+
+	spin_lock(&pool->lock);
+	pool->dead = 1;
+	used = pool->used;
+	spin_unlock(&pool->lock);
+
+	for (cls = 0; cls < _CLS_NR; cls++) {
+		for (dat = pool->free[cls]; dat; dat = ndat) {
+			ndat = dat->next;
+			kfree(dat);
+		}
+		pool->free[cls] = NULL;
+	}
+
+	/* Otherwise the last rt_vbus_pool_put frees it. The caller makes sure
+	 * nobody gets from the pool any more. */
+	if (used == 0)
+		kfree(pool);
+}
+
+struct rt_vbus_data* rt_vbus_pool_get(struct rt_vbus_pool *pool, size_t size)
+{
+	unsigned int cls;
+	struct rt_vbus_data *dat;
+
+	for (cls = 0; cls < _CLS_NR - 1 && _cls_sz[cls] < size; cls++)
+		;
+	BUG_ON(size > _cls_sz[cls]);
+
+	spin_lock(&pool->lock);
+	dat = pool->free[cls];
+	if (dat) {
+		pool->free[cls] = dat->next;
+		pool->free_nr[cls]--;
+	}
+	pool->used++;
+	spin_unlock(&pool->lock);
+
+	if (!dat) {
+		dat = _buf_alloc(pool, cls, GFP_KERNEL | __GFP_NOWARN);
+		if (!dat) {
+			spin_lock(&pool->lock);
+			pool->used--;
+			spin_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+
+	dat->size = size;
+	dat->next = NULL;
+	dat->bulk = NULL;
+	return dat;
+}
+
+void rt_vbus_pool_put(struct rt_vbus_data *dat)
+{
+	int release = 0;
+	struct rt_vbus_pool *pool = dat->pool;
+
+	spin_lock(&pool->lock);
+	pool->used--;
+	if (pool->dead) {
+		release = pool->used == 0;
+	} else if (pool->free_nr[dat->cls] < pool->nr) {
+		dat->next = pool->free[dat->cls];
+		pool->free[dat->cls] = dat;
+		pool->free_nr[dat->cls]++;
+		dat = NULL;
+	}
+	spin_unlock(&pool->lock);
+
+	kfree(dat);
+	if (release)
+		kfree(pool);
+}
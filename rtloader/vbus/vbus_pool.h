@@ -0,0 +1,52 @@
+/*
+ *  VMM Bus receive buffer pool
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#ifndef __VBUS_POOL_H__
+#define __VBUS_POOL_H__
+
+struct rt_vbus_data;
+struct rt_vbus_pool;
+
+/** Create a pool with nr pre-allocated buffers in each size class.
+ */
+struct rt_vbus_pool* rt_vbus_pool_create(unsigned int nr);
+/** Delete the pool.
+ *
+ * The buffers still in use are freed when they are put back.
+ */
+void rt_vbus_pool_delete(struct rt_vbus_pool *pool);
+/** Get a buffer for size bytes of data.
+ *
+ * It is taken from the smallest class that fits. If the class is empty, a new
+ * buffer of the class is allocated and kept by the pool once it is put back.
+ * Return NULL only if that allocation failed.
+ */
+struct rt_vbus_data* rt_vbus_pool_get(struct rt_vbus_pool *pool, size_t size);
+void rt_vbus_pool_put(struct rt_vbus_data *dat);
+
+#endif /* end of include guard: __VBUS_POOL_H__ */
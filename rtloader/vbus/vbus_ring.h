@@ -0,0 +1,473 @@
+/*
+ *  VMM Bus ring helpers
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+/* The ring logic shared by the driver and the userspace benchmark in
+ * linux-apps. Everything is inline and only depends on vbus_api.h and
+ * vbus_layout.h, so it could be built with or without __KERNEL__. */
+
+#ifndef __VBUS_RING_H__
+#define __VBUS_RING_H__
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/atomic.h>
+
+typedef atomic64_t rt_vbus_atomic_t;
+#define rt_vbus_atomic_read(a)          atomic64_read(a)
+#define rt_vbus_atomic_set(a, v)        atomic64_set(a, v)
+#define rt_vbus_atomic_cmpxchg(a, o, n) atomic64_cmpxchg(a, o, n)
+#define rt_vbus_cpu_relax()             cpu_relax()
+#define RT_VBUS_ACCESS_ONCE(x)          ACCESS_ONCE(x)
+#else
+#include <stddef.h>
+#include <string.h>
+
+typedef struct { volatile long long counter; } rt_vbus_atomic_t;
+
+static inline long long rt_vbus_atomic_read(rt_vbus_atomic_t *a)
+{
+	return __atomic_load_n(&a->counter, __ATOMIC_SEQ_CST);
+}
+
+static inline void rt_vbus_atomic_set(rt_vbus_atomic_t *a, long long v)
+{
+	__atomic_store_n(&a->counter, v, __ATOMIC_SEQ_CST);
+}
+
+/* Return the old value like the kernel one. */
+static inline long long rt_vbus_atomic_cmpxchg(rt_vbus_atomic_t *a,
+					       long long o, long long n)
+{
+	__atomic_compare_exchange_n(&a->counter, &o, n, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return o;
+}
+
+#define smp_rmb()               __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()               __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+/* The user could give a yielding one if the threads outnumber the cpus. */
+#ifndef rt_vbus_cpu_relax
+#define rt_vbus_cpu_relax()     __asm__ __volatile__("" : : : "memory")
+#endif
+#define RT_VBUS_ACCESS_ONCE(x)  (*(volatile __typeof__(x) *)&(x))
+#endif
+
+#include <vbus_api.h>
+#include <vbus_layout.h>
+
+/* 4 bytes for the head */
+#define LEN2BNR(len)    ((len + RT_VBUS_BLK_HEAD_SZ \
+			  + sizeof(struct rt_vbus_blk) - 1) \
+			 / sizeof(struct rt_vbus_blk))
+
+/* View of a ring that does not depend on the layout in use.
+ *
+ * The indexes count blocks in V1 and V2, 8-byte units in V3. They are all
+ * called blocks below.
+ */
+struct rt_vbus_ring_ctx {
+	volatile size_t *put_idx;
+	volatile size_t *get_idx;
+	volatile unsigned int *blocked;
+	/* Event index, see struct rt_vbus_ring_evt. */
+	volatile unsigned int *put_event;
+	volatile unsigned int *get_event;
+	/* Only one of them is used, depending on the layout. */
+	struct rt_vbus_blk *blks;
+	struct rt_vbus_rec *recs;
+	unsigned int blk_nr;
+	/* Biggest packet that could be put without splitting. */
+	unsigned int max_pkt;
+	int layout;
+	void *base;
+	/* Last seen put_idx of the ring we consume. The producers keep the
+	 * shadow of get_idx in the reserve word, see rt_vbus_ring_reserve. */
+	unsigned int shadow;
+};
+
+/* Set up the ctx for the ring area of size bytes at base. */
+static inline void rt_vbus_ring_ctx_init(struct rt_vbus_ring_ctx *ctx,
+					 void *base, size_t size, int layout)
+{
+	if (layout == RT_VBUS_LAYOUT_V2 || layout == RT_VBUS_LAYOUT_V3) {
+		/* V3 has the same header. */
+		struct rt_vbus_ring_v2 *rg = base;
+
+		ctx->put_idx   = &rg->prod.put_idx;
+		ctx->get_idx   = &rg->cons.get_idx;
+		ctx->blocked   = &rg->prod.blocked;
+		ctx->put_event = &rg->cons.put_event;
+		ctx->get_event = &rg->prod.get_event;
+		ctx->blks      = rg->blks;
+		ctx->recs      = (struct rt_vbus_rec*)rg->blks;
+		if (layout == RT_VBUS_LAYOUT_V3) {
+			ctx->blk_nr  = (size - 2 * RT_VBUS_CACHE_LINE_SZ)
+				       / RT_VBUS_REC_SZ;
+			ctx->max_pkt = RT_VBUS_V3_MAX_PKT_SZ;
+		} else {
+			ctx->blk_nr  = size / sizeof(struct rt_vbus_blk) - 2;
+			ctx->max_pkt = RT_VBUS_MAX_PKT_SZ;
+		}
+	} else {
+		struct rt_vbus_ring *rg = base;
+		struct rt_vbus_ring_evt *evt;
+
+		evt = (struct rt_vbus_ring_evt*)((char*)base + size - sizeof(*evt));
+		ctx->put_idx   = &rg->put_idx;
+		ctx->get_idx   = &rg->get_idx;
+		ctx->blocked   = &rg->blocked;
+		ctx->put_event = &evt->put_event;
+		ctx->get_event = &evt->get_event;
+		ctx->blks      = rg->blks;
+		ctx->recs      = NULL;
+		ctx->blk_nr    = size / sizeof(struct rt_vbus_blk) - 1;
+		ctx->max_pkt   = RT_VBUS_MAX_PKT_SZ;
+	}
+	ctx->layout = layout;
+	ctx->base   = base;
+	ctx->shadow = *ctx->get_idx;
+}
+
+/* Empty the V2 or V3 ring and mark it ready for the producer. Done by the
+ * consumer. */
+static inline void rt_vbus_ring_v2_format(struct rt_vbus_ring_v2 *rg,
+					  int layout)
+{
+	rg->prod.put_idx   = 0;
+	rg->prod.get_event = 0;
+	rg->prod.blocked   = 0;
+	rg->cons.get_idx   = 0;
+	rg->cons.put_event = 0;
+	smp_wmb();
+	rg->cons.layout = RT_VBUS_LAYOUT_MAGIC | layout;
+}
+
+/* Free blocks of a ring with the given indexes. */
+static inline int rt_vbus_ring_space_nr(struct rt_vbus_ring_ctx *rg,
+					unsigned int get, unsigned int put)
+{
+	int delta = get - put;
+
+	if (delta > 0) {
+		/* Put is behind the get. */
+		return delta - 1;
+	} else {
+		/* delta is negative. */
+		return rg->blk_nr + delta - 1;
+	}
+}
+
+/* Blocks taken by a packet of len bytes. */
+static inline unsigned int rt_vbus_ring_pkt_nr(struct rt_vbus_ring_ctx *rg,
+					       size_t len)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return 1 + (len + RT_VBUS_REC_SZ - 1) / RT_VBUS_REC_SZ;
+	return LEN2BNR(len);
+}
+
+/* Blocks a reservation of dnr blocks at idx really takes. A V3 reservation
+ * is contiguous, so the tail of the ring is skipped if it does not fit in. */
+static inline unsigned int rt_vbus_ring_rsv_nr(struct rt_vbus_ring_ctx *rg,
+					       unsigned int idx,
+					       unsigned int dnr)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3 && idx + dnr > rg->blk_nr)
+		return dnr + rg->blk_nr - idx;
+	return dnr;
+}
+
+/* Biggest reservation that could always be made once the ring is drained. */
+static inline unsigned int rt_vbus_ring_max_nr(struct rt_vbus_ring_ctx *rg)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return (rg->blk_nr - 1) / 2;
+	return rg->blk_nr - 1;
+}
+
+/* Fill nr blocks at idx with a PAD record. */
+static inline void rt_vbus_ring_put_pad(struct rt_vbus_ring_ctx *rg,
+					unsigned int idx, unsigned int nr)
+{
+	rg->recs[idx].id    = 0;
+	rg->recs[idx].qos   = 0;
+	rg->recs[idx].flags = RT_VBUS_REC_F_PAD;
+	rg->recs[idx].len   = (nr - 1) * RT_VBUS_REC_SZ;
+}
+
+/* Where to put the packets of a reservation of dnr blocks at start. */
+static inline unsigned int rt_vbus_ring_data_start(struct rt_vbus_ring_ctx *rg,
+						   unsigned int start,
+						   unsigned int dnr)
+{
+	if (rt_vbus_ring_rsv_nr(rg, start, dnr) == dnr)
+		return start;
+
+	rt_vbus_ring_put_pad(rg, start, rg->blk_nr - start);
+	return 0;
+}
+
+static inline unsigned int rt_vbus_ring_put_rec(struct rt_vbus_ring_ctx *rg,
+						unsigned int idx,
+						unsigned char id,
+						unsigned char prio,
+						const void *data, size_t len,
+						unsigned short flags)
+{
+	unsigned int nr = rt_vbus_ring_pkt_nr(rg, len);
+
+	/* Same decision as rt_vbus_ring_reserve. */
+	if (idx + nr > rg->blk_nr) {
+		rt_vbus_ring_put_pad(rg, idx, rg->blk_nr - idx);
+		idx = 0;
+	}
+
+	rg->recs[idx].id    = id;
+	rg->recs[idx].qos   = prio;
+	rg->recs[idx].flags = flags;
+	rg->recs[idx].len   = len;
+	memcpy(&rg->recs[idx + 1], data, len);
+
+	idx += nr;
+	return idx == rg->blk_nr ? 0 : idx;
+}
+
+/* Write a fragment at the block idx without publishing it, marked if more
+ * is not 0. Return the index of the block after the packet. There should be
+ * enough space. */
+static inline unsigned int rt_vbus_ring_put_frag(struct rt_vbus_ring_ctx *rg,
+						 unsigned int idx,
+						 unsigned char id,
+						 unsigned char prio,
+						 const void *data, size_t len,
+						 int more)
+{
+	unsigned int nxtidx;
+
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return rt_vbus_ring_put_rec(rg, idx, id, prio, data, len,
+					    more ? RT_VBUS_REC_F_MORE : 0);
+
+	nxtidx = idx + LEN2BNR(len);
+
+	rg->blks[idx].id  = id;
+	rg->blks[idx].qos = prio;
+	rg->blks[idx].len = len;
+	rg->blks[idx].reserved = more ? RT_VBUS_BLK_F_MORE : 0;
+
+	if (nxtidx >= rg->blk_nr) {
+		unsigned int tailsz;
+
+		tailsz = (rg->blk_nr - idx)
+			* sizeof(rg->blks[0]) - RT_VBUS_BLK_HEAD_SZ;
+
+		/* the remaining block is sufficient for the data */
+		if (tailsz > len)
+			tailsz = len;
+
+		memcpy(&rg->blks[idx].data, data, tailsz);
+		memcpy(&rg->blks[0], ((char*)data)+tailsz, len - tailsz);
+
+		return nxtidx - rg->blk_nr;
+	} else {
+		memcpy(&rg->blks[idx].data, data, len);
+
+		return nxtidx;
+	}
+}
+
+/* Write a packet at the block idx without publishing it. */
+static inline unsigned int rt_vbus_ring_put_pkt(struct rt_vbus_ring_ctx *rg,
+						unsigned int idx,
+						unsigned char id,
+						unsigned char prio,
+						const void *data, size_t len)
+{
+	return rt_vbus_ring_put_frag(rg, idx, id, prio, data, len, 0);
+}
+
+/* Head of the packet at the block get. Return the payload, or NULL if it is
+ * a PAD record, which should be skipped by its rt_vbus_ring_pkt_nr(len). */
+static inline void* rt_vbus_ring_pkt(struct rt_vbus_ring_ctx *rg,
+				     unsigned int get,
+				     unsigned int *id, size_t *len)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3) {
+		struct rt_vbus_rec *rec = &rg->recs[get];
+
+		*id  = rec->id;
+		*len = rec->len;
+		return rec->flags & RT_VBUS_REC_F_PAD ? NULL : rec + 1;
+	}
+
+	*id  = rg->blks[get].id;
+	*len = rg->blks[get].len;
+	return rg->blks[get].data;
+}
+
+/* Whether the packet at the block get is followed by more fragments of the
+ * message. */
+static inline int rt_vbus_ring_pkt_more(struct rt_vbus_ring_ctx *rg,
+					unsigned int get)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return rg->recs[get].flags & RT_VBUS_REC_F_MORE;
+	return rg->blks[get].reserved & RT_VBUS_BLK_F_MORE;
+}
+
+/* qos of the packet at the block get. */
+static inline unsigned int rt_vbus_ring_pkt_qos(struct rt_vbus_ring_ctx *rg,
+						unsigned int get)
+{
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return rg->recs[get].qos;
+	return rg->blks[get].qos;
+}
+
+/* Bytes of the packet of size at the block get that are before the end of
+ * the ring. The rest is from blks[0]. */
+static inline unsigned int rt_vbus_ring_pkt_tailsz(struct rt_vbus_ring_ctx *rg,
+						   unsigned int get,
+						   size_t size)
+{
+	/* The V3 records never wrap. */
+	if (rg->layout == RT_VBUS_LAYOUT_V3)
+		return size;
+	if (get + LEN2BNR(size) > rg->blk_nr)
+		/* The data wraps around the end of the ring. */
+		return (rg->blk_nr - get) * sizeof(rg->blks[0])
+			- RT_VBUS_BLK_HEAD_SZ;
+	return size;
+}
+
+/* Consume bnr blocks. */
+static inline void rt_vbus_ring_add_get_bnr(struct rt_vbus_ring_ctx *ring,
+					    size_t bnr)
+{
+	unsigned int nidx = *ring->get_idx + bnr;
+
+	if (nidx >= ring->blk_nr) {
+		nidx -= ring->blk_nr;
+	}
+	smp_wmb();
+	*ring->get_idx = nidx;
+}
+
+/* Whether there is data in the ring we consume. Only look at the put_idx
+ * written by the other side when the shadow says the ring is empty. */
+static inline int rt_vbus_ring_has_data(struct rt_vbus_ring_ctx *rg)
+{
+	if (*rg->get_idx != rg->shadow)
+		return 1;
+
+	rg->shadow = *rg->put_idx;
+	smp_rmb();
+	return *rg->get_idx != rg->shadow;
+}
+
+/* The reserve word of the producers: the next block to be reserved in the
+ * low 32 bits and the shadow of get_idx in the high 32 bits. They are updated
+ * together so the shadow never goes backward. */
+#define RT_VBUS_RSV_IDX(v)          ((unsigned int)(v))
+#define RT_VBUS_RSV_SHADOW(v)       ((unsigned int)((unsigned long long)(v) >> 32))
+#define RT_VBUS_RSV_MK(shadow, idx) \
+	((long long)(((unsigned long long)(shadow) << 32) | (idx)))
+
+static inline void rt_vbus_ring_reserve_init(struct rt_vbus_ring_ctx *rg,
+					     rt_vbus_atomic_t *rsv)
+{
+	rt_vbus_atomic_set(rsv, RT_VBUS_RSV_MK(*rg->get_idx, *rg->put_idx));
+}
+
+/* Free blocks of the ring. The blocks reserved but not committed yet are
+ * counted as used. */
+static inline int rt_vbus_ring_free_nr(struct rt_vbus_ring_ctx *rg,
+				       rt_vbus_atomic_t *rsv)
+{
+	unsigned int idx = RT_VBUS_RSV_IDX(rt_vbus_atomic_read(rsv));
+
+	smp_rmb();
+	return rt_vbus_ring_space_nr(rg, *rg->get_idx, idx);
+}
+
+/* Reserve dnr blocks without any lock. Several producers could reserve at
+ * the same time. Return 0 and the first reserved block in *start on success,
+ * -1 if there is no room. In V3 the packets should be put from
+ * rt_vbus_ring_data_start, unless it is a single one.
+ *
+ * The producer should not be preempted before rt_vbus_ring_commit because
+ * the producers behind it will spin until it commits.
+ */
+static inline int rt_vbus_ring_reserve(struct rt_vbus_ring_ctx *rg,
+				       rt_vbus_atomic_t *rsv,
+				       int dnr, unsigned int *start)
+{
+	long long old;
+	unsigned int idx, get, new;
+	int need;
+
+	do {
+		old  = rt_vbus_atomic_read(rsv);
+		idx  = RT_VBUS_RSV_IDX(old);
+		get  = RT_VBUS_RSV_SHADOW(old);
+		need = rt_vbus_ring_rsv_nr(rg, idx, dnr);
+
+		if (rt_vbus_ring_space_nr(rg, get, idx) < need) {
+			/* Only touch the line of the other side when the
+			 * shadow says there is no room. */
+			smp_rmb();
+			get = *rg->get_idx;
+			if (rt_vbus_ring_space_nr(rg, get, idx) < need)
+				return -1;
+		}
+
+		new = idx + need;
+		if (new >= rg->blk_nr)
+			new -= rg->blk_nr;
+	} while (rt_vbus_atomic_cmpxchg(rsv, old,
+					RT_VBUS_RSV_MK(get, new)) != old);
+
+	*start = idx;
+	return 0;
+}
+
+/* Publish the blocks in [start, end). The reservations are published in the
+ * order they are made so wait for the producers in front of us first. */
+static inline void rt_vbus_ring_commit(struct rt_vbus_ring_ctx *rg,
+				       unsigned int start, unsigned int end)
+{
+	while (RT_VBUS_ACCESS_ONCE(*rg->put_idx) != start)
+		rt_vbus_cpu_relax();
+
+	smp_wmb();
+	*rg->put_idx = end;
+}
+
+#endif /* end of include guard: __VBUS_RING_H__ */
@@ -0,0 +1,190 @@
+/*
+ *  VMM Bus mmap-able receive area
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+/* The area is a byte ring of payloads plus a ring of descriptors pointing to
+ * them. A payload never wraps around the end of the data region so the user
+ * could use it in place. The kernel is the only writer of the area, the user
+ * gives back the descriptors by ioctl. */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/log2.h>
+
+#include "vbus_rxmap.h"
+
+/* Keep the payloads aligned. */
+#define _RXMAP_ALIGN    8
+
+static inline unsigned int _data_sz(struct rt_vbus_rxmap *map)
+{
+	return map->size - PAGE_SIZE;
+}
+
+struct rt_vbus_rxmap* rt_vbus_rxmap_create(size_t size)
+{
+	struct rt_vbus_rxmap *map;
+
+	/* At least one page for the header and one page for the data. */
+	if (size < 2 * PAGE_SIZE || size & ~PAGE_MASK)
+		return ERR_PTR(-EINVAL);
+
+	map = kzalloc(sizeof(*map), GFP_KERNEL);
+	if (!map)
+		return ERR_PTR(-ENOMEM);
+
+	map->area = vmalloc_user(size);
+	if (!map->area)
+		goto _free_map;
+
+	map->size = size;
+	map->hdr  = map->area;
+	map->desc = (struct rt_vbus_rxmap_desc*)(map->hdr + 1);
+
+	/* Power of 2 so the free running indexes could wrap around. */
+	map->hdr->desc_nr = rounddown_pow_of_two((PAGE_SIZE - sizeof(*map->hdr))
+						 / sizeof(struct rt_vbus_rxmap_desc));
+	map->hdr->size = size;
+
+	map->charge = kcalloc(map->hdr->desc_nr, sizeof(*map->charge),
+			      GFP_KERNEL);
+	if (!map->charge)
+		goto _free_area;
+
+	spin_lock_init(&map->lock);
+
+	return map;
+
+_free_area:
+	vfree(map->area);
+_free_map:
+	kfree(map);
+	return ERR_PTR(-ENOMEM);
+}
+
+void rt_vbus_rxmap_delete(struct rt_vbus_rxmap *map)
+{
+	kfree(map->charge);
+	vfree(map->area);
+	kfree(map);
+}
+
+int rt_vbus_rxmap_put(struct rt_vbus_rxmap *map,
+		      const void *d0, size_t l0,
+		      const void *d1, size_t l1)
+{
+	unsigned int len = l0 + l1;
+	unsigned int start, charge, slot;
+	char *dst;
+
+	spin_lock(&map->lock);
+
+	if (map->hdr->prod - map->hdr->cons >= map->hdr->desc_nr)
+		goto _nospc;
+
+	start  = map->data_head;
+	charge = ALIGN(len, _RXMAP_ALIGN);
+	/* Skip the tail of the region if the payload does not fit in. */
+	if (start + len > _data_sz(map)) {
+		charge += _data_sz(map) - start;
+		start = 0;
+	}
+
+	if (map->data_used + charge > _data_sz(map))
+		goto _nospc;
+
+	dst = (char*)map->area + PAGE_SIZE + start;
+	memcpy(dst, d0, l0);
+	if (l1)
+		memcpy(dst + l0, d1, l1);
+
+	slot = map->hdr->prod & (map->hdr->desc_nr - 1);
+	map->desc[slot].off = PAGE_SIZE + start;
+	map->desc[slot].len = len;
+	map->charge[slot]   = charge;
+
+	map->data_head  = start + ALIGN(len, _RXMAP_ALIGN);
+	if (map->data_head >= _data_sz(map))
+		map->data_head = 0;
+	map->data_used += charge;
+
+	/* The payload and the descriptor should be visible before the index. */
+	smp_wmb();
+	map->hdr->prod++;
+
+	spin_unlock(&map->lock);
+	return 0;
+
+_nospc:
+	spin_unlock(&map->lock);
+	return -ENOSPC;
+}
+
+unsigned int rt_vbus_rxmap_consume(struct rt_vbus_rxmap *map,
+				   unsigned int nr)
+{
+	unsigned int i, avail;
+
+	spin_lock(&map->lock);
+
+	avail = map->hdr->prod - map->hdr->cons;
+	if (nr > avail)
+		nr = avail;
+
+	for (i = 0; i < nr; i++) {
+		unsigned int slot = map->hdr->cons & (map->hdr->desc_nr - 1);
+
+		map->data_used -= map->charge[slot];
+		map->hdr->cons++;
+	}
+
+	spin_unlock(&map->lock);
+
+	return nr;
+}
+
+int rt_vbus_rxmap_empty(struct rt_vbus_rxmap *map)
+{
+	smp_rmb();
+	return map->hdr->prod == map->hdr->cons;
+}
+
+int rt_vbus_rxmap_mmap(struct rt_vbus_rxmap *map,
+		       struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != map->size)
+		return -EINVAL;
+
+	/* Only the kernel could write to the area. */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, map->area, 0);
+}
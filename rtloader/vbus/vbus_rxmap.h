@@ -0,0 +1,75 @@
+/*
+ *  VMM Bus mmap-able receive area
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#ifndef __VBUS_RXMAP_H__
+#define __VBUS_RXMAP_H__
+
+#include "rt_vbus_user.h"
+
+struct rt_vbus_rxmap {
+	/* The whole area, header page first. It is mapped into the user
+	 * space read-only. */
+	void *area;
+	size_t size;
+
+	struct rt_vbus_rxmap_hdr *hdr;
+	struct rt_vbus_rxmap_desc *desc;
+
+	/* Write position and the bytes in use of the data region. Only the
+	 * kernel touches them. */
+	unsigned int data_head, data_used;
+	/* Bytes charged by each descriptor, including the skipped tail of the
+	 * region. Given back when consuming. */
+	unsigned int *charge;
+
+	spinlock_t lock;
+};
+
+struct rt_vbus_rxmap* rt_vbus_rxmap_create(size_t size);
+void rt_vbus_rxmap_delete(struct rt_vbus_rxmap *map);
+
+/** Put a packet into the area.
+ *
+ * The packet may be splitted into two parts because it wraps around the end
+ * of the ring. It will be stored continuously in the area. Return -ENOSPC if
+ * there is no room for it.
+ */
+int rt_vbus_rxmap_put(struct rt_vbus_rxmap *map,
+		      const void *d0, size_t l0,
+		      const void *d1, size_t l1);
+/** Give back the nr oldest descriptors and the data they point to.
+ *
+ * Return the number of descriptors really consumed.
+ */
+unsigned int rt_vbus_rxmap_consume(struct rt_vbus_rxmap *map,
+				   unsigned int nr);
+int rt_vbus_rxmap_empty(struct rt_vbus_rxmap *map);
+int rt_vbus_rxmap_mmap(struct rt_vbus_rxmap *map,
+		       struct vm_area_struct *vma);
+
+#endif /* end of include guard: __VBUS_RXMAP_H__ */
@@ -0,0 +1,600 @@
+/*
+ *  VMM Bus socket family
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+/* Sockets over the VBUS channels.
+ *
+ * bind(2) and listen(2) wait for a channel of the name as a server, connect(2)
+ * requests it as a client. The data path is shared with the channel fds in
+ * vbus_chnx.c.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/net.h>
+#include <linux/socket.h>
+#include <net/sock.h>
+
+#include <vbus_api.h>
+
+#include "linux_driver.h"
+#include "vbus_chnx.h"
+#include "vbus_sock.h"
+
+#ifdef RT_VBUS_USING_SOCKET
+
+/* There is no number of our own, so no default either. 0 leaves the sockets
+ * off. */
+static int family;
+module_param(family, int, 0444);
+MODULE_PARM_DESC(family, "address family of the vbus sockets, 0 for none");
+
+struct vbus_sock {
+	/* Should be the first. */
+	struct sock sk;
+	char name[RT_VBUS_CHN_NAME_MAX];
+	struct rt_vbus_request req;
+	/* The channel once connected or accepted, -1 before. */
+	int chnr;
+	/* Pending request of the listening socket, -1 if none. There is only
+	 * one, so the backlog is always 1. */
+	int handle;
+	int settled;
+	/* The buffer sizes the water marks are set from. */
+	int rcvbuf, sndbuf;
+	/* VBUS_SO_ZEROCOPY */
+	int zerocopy;
+};
+
+static inline struct vbus_sock* vbus_sk(struct sock *sk)
+{
+	return (struct vbus_sock*)sk;
+}
+
+static struct proto _vbus_proto = {
+	.name     = "VBUS",
+	.owner    = THIS_MODULE,
+	.obj_size = sizeof(struct vbus_sock),
+};
+
+static int _registered;
+
+static void _vbus_sock_init(struct vbus_sock *vs)
+{
+	vs->name[0] = '\0';
+	vs->chnr    = -1;
+	vs->handle  = -1;
+	vs->settled = 0;
+	vs->zerocopy = 0;
+}
+
+/* The water marks count packets. Take the buffer as the max packets. */
+static void _vbus_sock_wm(int bytes, struct rt_vbus_wm_cfg *wm)
+{
+	wm->high = max(bytes / RT_VBUS_MAX_PKT_SZ, 2);
+	wm->low  = wm->high / 2;
+}
+
+static void _vbus_sock_fill_req(struct vbus_sock *vs, int is_server)
+{
+	struct sock *sk = &vs->sk;
+
+	memset(&vs->req, 0, sizeof(vs->req));
+	vs->req.name      = vs->name;
+	vs->req.is_server = is_server;
+	vs->req.prio      = min_t(unsigned int, sk->sk_priority, 255);
+	if (sk->sk_type == SOCK_SEQPACKET)
+		vs->req.flags = RT_VBUS_REQ_DGRAM;
+	_vbus_sock_wm(sk->sk_rcvbuf, &vs->req.recv_wm);
+	_vbus_sock_wm(sk->sk_sndbuf, &vs->req.post_wm);
+	vs->rcvbuf = sk->sk_rcvbuf;
+	vs->sndbuf = sk->sk_sndbuf;
+}
+
+/* SO_RCVBUF and SO_SNDBUF are set by the socket core, pick up the changes
+ * before the data goes. */
+static void _vbus_sock_sync_buf(struct vbus_sock *vs, int chnr)
+{
+	struct sock *sk = &vs->sk;
+	struct rt_vbus_wm_cfg wm;
+	int buf;
+
+	buf = ACCESS_ONCE(sk->sk_rcvbuf);
+	if (buf != vs->rcvbuf) {
+		vs->rcvbuf = buf;
+		_vbus_sock_wm(buf, &wm);
+		rt_vbus_set_recv_wm(chnr, wm.low, wm.high);
+	}
+
+	buf = ACCESS_ONCE(sk->sk_sndbuf);
+	if (buf != vs->sndbuf) {
+		vs->sndbuf = buf;
+		_vbus_sock_wm(buf, &wm);
+		rt_vbus_set_post_wm(chnr, wm.low, wm.high);
+	}
+}
+
+static void _vbus_sock_attach(struct vbus_sock *vs, int chnr)
+{
+	vbus_chnx_attach(chnr, vs->req.prio, vs->req.flags);
+	vs->chnr = chnr;
+	vs->sk.sk_state = TCP_ESTABLISHED;
+	vs->sk.sk_socket->state = SS_CONNECTED;
+}
+
+/* Copy the name out of the address. */
+static int _vbus_sock_addr(struct sockaddr *uaddr, int len, char *name)
+{
+	struct sockaddr_vbus *addr = (struct sockaddr_vbus*)uaddr;
+	size_t nlen;
+
+	if (len < sizeof(*addr) || addr->svbus_family != family)
+		return -EINVAL;
+
+	nlen = strnlen(addr->svbus_name, sizeof(addr->svbus_name));
+	if (nlen == 0 ||
+	    nlen >= min_t(size_t, sizeof(addr->svbus_name),
+			  RT_VBUS_CHN_NAME_MAX))
+		return -EINVAL;
+	memcpy(name, addr->svbus_name, nlen + 1);
+	return 0;
+}
+
+/* Runs under a spinlock of the driver. */
+static void _vbus_sock_settled(void *arg, int chnr)
+{
+	struct vbus_sock *vs = arg;
+
+	vs->settled = 1;
+	wake_up_interruptible(sk_sleep(&vs->sk));
+}
+
+/* Wait for the next client of the name. */
+static int _vbus_sock_arm(struct vbus_sock *vs)
+{
+	int handle;
+
+	vs->settled = 0;
+	_vbus_sock_fill_req(vs, 1);
+	handle = rt_vbus_request_chn_async(&vs->req, 1, vbus_chnx_callback,
+					   _vbus_sock_settled, vs);
+	if (handle < 0)
+		return handle;
+
+	vs->handle = handle;
+	return 0;
+}
+
+static int _vbus_sock_release(struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs;
+
+	if (!sk)
+		return 0;
+	vs = vbus_sk(sk);
+
+	lock_sock(sk);
+	if (vs->handle >= 0) {
+		rt_vbus_request_cancel(vs->handle);
+		vs->handle = -1;
+	}
+	if (vs->chnr > 0) {
+		vbus_chnx_detach(vs->chnr);
+		vs->chnr = -1;
+	}
+	sk->sk_state = TCP_CLOSE;
+	sock_orphan(sk);
+	sock->sk = NULL;
+	release_sock(sk);
+
+	sock_put(sk);
+	return 0;
+}
+
+static int _vbus_sock_bind(struct socket *sock, struct sockaddr *uaddr,
+			   int len)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	int res = -EINVAL;
+
+	lock_sock(sk);
+	if (vs->chnr < 0 && vs->handle < 0)
+		res = _vbus_sock_addr(uaddr, len, vs->name);
+	release_sock(sk);
+
+	return res;
+}
+
+static int _vbus_sock_listen(struct socket *sock, int backlog)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	int res = -EINVAL;
+
+	lock_sock(sk);
+	if (sock->state != SS_UNCONNECTED || vs->name[0] == '\0')
+		goto out;
+
+	res = 0;
+	if (sk->sk_state == TCP_LISTEN)
+		goto out;
+
+	res = _vbus_sock_arm(vs);
+	if (res == 0)
+		sk->sk_state = TCP_LISTEN;
+out:
+	release_sock(sk);
+	return res;
+}
+
+/* The request always waits for the other side, O_NONBLOCK is not honored. */
+static int _vbus_sock_connect(struct socket *sock, struct sockaddr *uaddr,
+			      int len, int flags)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	int chnr, res;
+
+	lock_sock(sk);
+	if (sock->state == SS_CONNECTED) {
+		res = -EISCONN;
+		goto out;
+	}
+	if (sk->sk_state == TCP_LISTEN) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	res = _vbus_sock_addr(uaddr, len, vs->name);
+	if (res)
+		goto out;
+
+	_vbus_sock_fill_req(vs, 0);
+	chnr = rt_vbus_request_chn(&vs->req, 0, vbus_chnx_callback);
+	if (chnr < 0) {
+		res = chnr;
+		goto out;
+	}
+	_vbus_sock_attach(vs, chnr);
+out:
+	release_sock(sk);
+	return res;
+}
+
+static int _vbus_sock_graft(struct sock *sk, struct socket *newsock, int chnr)
+{
+	struct sock *newsk;
+	struct vbus_sock *nvs;
+
+	newsk = sk_alloc(sock_net(sk), family, GFP_KERNEL, sk->sk_prot);
+	if (!newsk)
+		return -ENOMEM;
+
+	sock_init_data(newsock, newsk);
+	newsk->sk_priority = sk->sk_priority;
+	newsk->sk_rcvbuf   = sk->sk_rcvbuf;
+	newsk->sk_sndbuf   = sk->sk_sndbuf;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	newsk->sk_ll_usec  = sk->sk_ll_usec;
+#endif
+
+	nvs = vbus_sk(newsk);
+	_vbus_sock_init(nvs);
+	memcpy(nvs->name, vbus_sk(sk)->name, sizeof(nvs->name));
+	_vbus_sock_fill_req(nvs, 1);
+	_vbus_sock_attach(nvs, chnr);
+	return 0;
+}
+
+static int _vbus_sock_accept(struct socket *sock, struct socket *newsock,
+			     int flags)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	long timeo = sock_rcvtimeo(sk, flags & O_NONBLOCK);
+	int chnr, res;
+
+	lock_sock(sk);
+	for (;;) {
+		if (sk->sk_state != TCP_LISTEN) {
+			res = -EINVAL;
+			goto out;
+		}
+		/* The request failed to be armed last time. */
+		if (vs->handle < 0) {
+			res = _vbus_sock_arm(vs);
+			if (res)
+				goto out;
+		}
+
+		chnr = rt_vbus_request_finish(vs->handle);
+		if (chnr != -EAGAIN)
+			break;
+
+		res = -EAGAIN;
+		if (!timeo)
+			goto out;
+
+		release_sock(sk);
+		timeo = wait_event_interruptible_timeout(*sk_sleep(sk),
+							 ACCESS_ONCE(vs->settled),
+							 timeo);
+		lock_sock(sk);
+		if (timeo < 0) {
+			res = timeo;
+			goto out;
+		}
+	}
+
+	/* Wait for the next client right away. */
+	vs->handle = -1;
+	res = _vbus_sock_arm(vs);
+	if (res)
+		pr_err("err listening on %s again: %d\n", vs->name, res);
+
+	if (chnr < 0) {
+		res = chnr;
+		goto out;
+	}
+
+	res = _vbus_sock_graft(sk, newsock, chnr);
+	if (res)
+		rt_vbus_close_chn(chnr);
+out:
+	release_sock(sk);
+	return res;
+}
+
+static int _vbus_sock_getname(struct socket *sock, struct sockaddr *uaddr,
+			      int *len, int peer)
+{
+	struct sockaddr_vbus *addr = (struct sockaddr_vbus*)uaddr;
+	struct vbus_sock *vs = vbus_sk(sock->sk);
+
+	if (peer && vs->chnr < 0)
+		return -ENOTCONN;
+
+	/* Both ends go by the name of the channel. */
+	memset(addr, 0, sizeof(*addr));
+	addr->svbus_family = family;
+	strlcpy(addr->svbus_name, vs->name, sizeof(addr->svbus_name));
+	*len = sizeof(*addr);
+	return 0;
+}
+
+static unsigned int _vbus_sock_poll(struct file *file, struct socket *sock,
+				    poll_table *wait)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	int chnr = ACCESS_ONCE(vs->chnr);
+
+	if (chnr > 0)
+		return vbus_chnx_poll_chn(chnr, file, wait);
+
+	poll_wait(file, sk_sleep(sk), wait);
+	if (sk->sk_state == TCP_LISTEN && ACCESS_ONCE(vs->settled))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int _vbus_sock_sendmsg(struct kiocb *iocb, struct socket *sock,
+			      struct msghdr *msg, size_t len)
+{
+	struct vbus_sock *vs = vbus_sk(sock->sk);
+	int nonblock = msg->msg_flags & MSG_DONTWAIT;
+	int chnr = ACCESS_ONCE(vs->chnr);
+	struct iov_iter from;
+
+	if (msg->msg_flags & MSG_OOB)
+		return -EOPNOTSUPP;
+	if (chnr < 0)
+		return -ENOTCONN;
+	if (len == 0)
+		return 0;
+
+	_vbus_sock_sync_buf(vs, chnr);
+
+	/* VBUS_SO_ZEROCOPY, post from the pinned user pages. The call returns
+	 * once the pages are read. */
+	if (ACCESS_ONCE(vs->zerocopy) && !nonblock && msg->msg_iovlen == 1)
+		return vbus_chnx_send_pinned(chnr, msg->msg_iov[0].iov_base, len);
+
+	iov_iter_init(&from, WRITE, msg->msg_iov, msg->msg_iovlen, len);
+	return vbus_chnx_send(chnr, &from, nonblock);
+}
+
+static int _vbus_sock_recvmsg(struct kiocb *iocb, struct socket *sock,
+			      struct msghdr *msg, size_t size, int flags)
+{
+	struct sock *sk = sock->sk;
+	struct vbus_sock *vs = vbus_sk(sk);
+	int nonblock = flags & MSG_DONTWAIT;
+	int chnr = ACCESS_ONCE(vs->chnr);
+	struct iov_iter to;
+	size_t msglen;
+	ssize_t res;
+
+	if (flags & (MSG_OOB | MSG_PEEK | MSG_ERRQUEUE))
+		return -EOPNOTSUPP;
+	if (chnr < 0)
+		return -ENOTCONN;
+
+	_vbus_sock_sync_buf(vs, chnr);
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* SO_BUSY_POLL, spin on the ring before going to sleep. */
+	if (ACCESS_ONCE(sk->sk_ll_usec) && !vbus_chnx_readable(chnr))
+		rt_vbus_busy_poll(chnr,
+				  nonblock ? 0 : ACCESS_ONCE(sk->sk_ll_usec));
+#endif
+
+	iov_iter_init(&to, READ, msg->msg_iov, msg->msg_iovlen, size);
+	res = vbus_chnx_recv(chnr, &to, nonblock, &msglen);
+	if (res <= 0)
+		return res;
+
+	if (sk->sk_type == SOCK_SEQPACKET && msglen > res) {
+		msg->msg_flags |= MSG_TRUNC;
+		if (flags & MSG_TRUNC)
+			return msglen;
+	}
+	return res;
+}
+
+static int _vbus_sock_setsockopt(struct socket *sock, int level, int optname,
+				 char __user *optval, unsigned int optlen)
+{
+	struct vbus_sock *vs = vbus_sk(sock->sk);
+	int val;
+
+	if (level != SOL_VBUS || optname != VBUS_SO_ZEROCOPY)
+		return -ENOPROTOOPT;
+	if (optlen < sizeof(int))
+		return -EINVAL;
+	if (get_user(val, (int __user *)optval))
+		return -EFAULT;
+
+	vs->zerocopy = !!val;
+	return 0;
+}
+
+static int _vbus_sock_getsockopt(struct socket *sock, int level, int optname,
+				 char __user *optval, int __user *optlen)
+{
+	struct vbus_sock *vs = vbus_sk(sock->sk);
+	int len;
+
+	if (level != SOL_VBUS || optname != VBUS_SO_ZEROCOPY)
+		return -ENOPROTOOPT;
+	if (get_user(len, optlen))
+		return -EFAULT;
+	if (len < (int)sizeof(int))
+		return -EINVAL;
+
+	len = sizeof(int);
+	if (put_user(vs->zerocopy, (int __user *)optval) ||
+	    put_user(len, optlen))
+		return -EFAULT;
+	return 0;
+}
+
+/* sendmmsg(2) and recvmmsg(2) come through sendmsg and recvmsg. */
+static struct proto_ops _vbus_sock_ops = {
+	.owner      = THIS_MODULE,
+	.release    = _vbus_sock_release,
+	.bind       = _vbus_sock_bind,
+	.connect    = _vbus_sock_connect,
+	.socketpair = sock_no_socketpair,
+	.accept     = _vbus_sock_accept,
+	.getname    = _vbus_sock_getname,
+	.poll       = _vbus_sock_poll,
+	.ioctl      = sock_no_ioctl,
+	.listen     = _vbus_sock_listen,
+	.shutdown   = sock_no_shutdown,
+	.setsockopt = _vbus_sock_setsockopt,
+	.getsockopt = _vbus_sock_getsockopt,
+	.sendmsg    = _vbus_sock_sendmsg,
+	.recvmsg    = _vbus_sock_recvmsg,
+	.mmap       = sock_no_mmap,
+	.sendpage   = sock_no_sendpage,
+};
+
+static int _vbus_sock_create(struct net *net, struct socket *sock,
+			     int protocol, int kern)
+{
+	struct sock *sk;
+
+	/* There is only one VBUS. */
+	if (!net_eq(net, &init_net))
+		return -EAFNOSUPPORT;
+	if (protocol)
+		return -EPROTONOSUPPORT;
+	if (sock->type != SOCK_STREAM && sock->type != SOCK_SEQPACKET)
+		return -ESOCKTNOSUPPORT;
+
+	sk = sk_alloc(net, family, GFP_KERNEL, &_vbus_proto);
+	if (!sk)
+		return -ENOMEM;
+
+	sock->ops = &_vbus_sock_ops;
+	sock_init_data(sock, sk);
+	_vbus_sock_init(vbus_sk(sk));
+	return 0;
+}
+
+static struct net_proto_family _vbus_sock_family = {
+	.create = _vbus_sock_create,
+	.owner  = THIS_MODULE,
+};
+
+int vbus_sock_init(void)
+{
+	int res;
+
+	if (family == 0) {
+		pr_info("vbus sockets off, set the family parameter for them\n");
+		return 0;
+	}
+	if (family < 0 || family >= NPROTO)
+		return -EINVAL;
+	_vbus_sock_ops.family    = family;
+	_vbus_sock_family.family = family;
+
+	res = proto_register(&_vbus_proto, 0);
+	if (res)
+		return res;
+
+	res = sock_register(&_vbus_sock_family);
+	if (res) {
+		if (res == -EEXIST)
+			pr_err("vbus socket family %d is taken\n", family);
+		proto_unregister(&_vbus_proto);
+		return res;
+	}
+
+	_registered = 1;
+	pr_info("vbus socket family: %d\n", family);
+	return 0;
+}
+
+void vbus_sock_exit(void)
+{
+	if (!_registered)
+		return;
+
+	sock_unregister(family);
+	proto_unregister(&_vbus_proto);
+	_registered = 0;
+}
+
+#endif /* RT_VBUS_USING_SOCKET */
@@ -0,0 +1,47 @@
+/*
+ *  VMM Bus socket family
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#ifndef __VBUS_SOCK_H__
+#define __VBUS_SOCK_H__
+
+#include "linux_driver.h"
+
+#ifdef RT_VBUS_USING_SOCKET
+int vbus_sock_init(void);
+void vbus_sock_exit(void);
+#else
+static inline int vbus_sock_init(void)
+{
+	return 0;
+}
+static inline void vbus_sock_exit(void)
+{
+}
+#endif
+
+#endif /* end of include guard: __VBUS_SOCK_H__ */
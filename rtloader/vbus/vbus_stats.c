@@ -0,0 +1,266 @@
+/*
+ *  VMM Bus statistics
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h>
+#include <linux/moduleparam.h>
+#include <linux/io.h>
+
+#include "vbus_stats.h"
+
+#ifdef RT_VBUS_USING_STATS
+
+struct rt_vbus_stats __percpu *rt_vbus_stats;
+struct rt_vbus_lat_hist __percpu *rt_vbus_lat;
+
+u32 *rt_vbus_lat_tbl;
+void __iomem *rt_vbus_lat_gt;
+
+bool rt_vbus_lat_on;
+
+/* The stamps left in the table would be taken as new by RT-Thread once we
+ * stop stamping. */
+static int _lat_on_set(const char *val, const struct kernel_param *kp)
+{
+	int res = param_set_bool(val, kp);
+
+	if (res == 0 && !rt_vbus_lat_on && rt_vbus_lat_tbl)
+		memset(rt_vbus_lat_tbl, 0, _RT_VBUS_LAT_TBL_SZ);
+	return res;
+}
+
+static const struct kernel_param_ops _lat_on_ops = {
+	.set = _lat_on_set,
+	.get = param_get_bool,
+};
+module_param_cb(lat_hist, &_lat_on_ops, &rt_vbus_lat_on, 0644);
+MODULE_PARM_DESC(lat_hist, "timestamp the messages for the latency histograms in debugfs and RT-Thread");
+
+static struct dentry *_stats_dir;
+
+static const char *_stat_names[RT_VBUS_STAT_NR] = {
+	[RT_VBUS_STAT_RX_PKTS]      = "rx_pkts",
+	[RT_VBUS_STAT_RX_BYTES]     = "rx_bytes",
+	[RT_VBUS_STAT_TX_PKTS]      = "tx_pkts",
+	[RT_VBUS_STAT_TX_BYTES]     = "tx_bytes",
+	[RT_VBUS_STAT_DROP_NOMEM]   = "drop_nomem",
+	[RT_VBUS_STAT_DROP_INVALID] = "drop_invalid",
+	[RT_VBUS_STAT_DROP_CLOSED]  = "drop_closed",
+	[RT_VBUS_STAT_DROP_RXMAP]   = "drop_rxmap",
+	[RT_VBUS_STAT_RX_STALLS]    = "rx_stalls",
+	[RT_VBUS_STAT_RX_URGENT]    = "rx_urgent",
+	[RT_VBUS_STAT_SUSPEND_TX]   = "suspend_tx",
+	[RT_VBUS_STAT_SUSPEND_RX]   = "suspend_rx",
+	[RT_VBUS_STAT_RESUME_TX]    = "resume_tx",
+	[RT_VBUS_STAT_RESUME_RX]    = "resume_rx",
+	[RT_VBUS_STAT_WM_WAIT_NS]   = "wm_wait_ns",
+	[RT_VBUS_STAT_RING_WAITS]   = "ring_waits",
+	[RT_VBUS_STAT_RING_WAIT_NS] = "ring_wait_ns",
+	[RT_VBUS_STAT_IPI_TX]       = "ipi_tx",
+	[RT_VBUS_STAT_IPI_RX]       = "ipi_rx",
+};
+
+static const char *_lat_names[RT_VBUS_LAT_NR] = {
+	[RT_VBUS_LAT_POST_COMMIT] = "post->commit",
+	[RT_VBUS_LAT_IPI_DRAIN]   = "ipi->drain",
+	[RT_VBUS_LAT_DRAIN_READ]  = "drain->read",
+};
+
+static u64 _stat_sum(unsigned int chnr, unsigned int item)
+{
+	int cpu;
+	u64 sum = 0;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(rt_vbus_stats, cpu)->cnt[chnr][item];
+	return sum;
+}
+
+static int _stats_show(struct seq_file *s, void *unused)
+{
+	unsigned int chnr, i;
+	u64 val[RT_VBUS_STAT_NR];
+
+	for (chnr = 0; chnr < RT_VBUS_CHANNEL_NR; chnr++) {
+		int used = 0;
+
+		for (i = 0; i < RT_VBUS_STAT_NR; i++) {
+			val[i] = _stat_sum(chnr, i);
+			used |= val[i] != 0;
+		}
+		if (!used)
+			continue;
+
+		seq_printf(s, "chn %u:\n", chnr);
+		for (i = 0; i < RT_VBUS_STAT_NR; i++) {
+			if (val[i])
+				seq_printf(s, "  %-14s %llu\n", _stat_names[i],
+					   (unsigned long long)val[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int _stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, _stats_show, NULL);
+}
+
+static int _lat_show(struct seq_file *s, void *unused)
+{
+	unsigned int chnr, st, b;
+	u64 val[RT_VBUS_LAT_BUCKETS];
+
+	for (chnr = 0; chnr < RT_VBUS_CHANNEL_NR; chnr++) {
+		for (st = 0; st < RT_VBUS_LAT_NR; st++) {
+			int cpu, used = 0;
+
+			for (b = 0; b < RT_VBUS_LAT_BUCKETS; b++) {
+				val[b] = 0;
+				for_each_possible_cpu(cpu)
+					val[b] += per_cpu_ptr(rt_vbus_lat, cpu)->cnt[chnr][st][b];
+				used |= val[b] != 0;
+			}
+			if (!used)
+				continue;
+
+			seq_printf(s, "chn %u %s:\n", chnr, _lat_names[st]);
+			for (b = 0; b < RT_VBUS_LAT_BUCKETS; b++) {
+				if (val[b])
+					seq_printf(s, "  %10llu - %10llu ns: %llu\n",
+						   b ? 1ULL << b : 0ULL,
+						   (2ULL << b) - 1,
+						   (unsigned long long)val[b]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int _lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, _lat_show, NULL);
+}
+
+static ssize_t _lat_write(struct file *file, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(rt_vbus_lat, cpu), 0,
+		       sizeof(struct rt_vbus_lat_hist));
+	return count;
+}
+
+/* The counters being updated on other CPUs may survive the clearing. It is
+ * good enough to start a new measurement. */
+static ssize_t _stats_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(rt_vbus_stats, cpu), 0,
+		       sizeof(struct rt_vbus_stats));
+	return count;
+}
+
+static const struct file_operations _stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = _stats_open,
+	.read    = seq_read,
+	.write   = _stats_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations _lat_fops = {
+	.owner   = THIS_MODULE,
+	.open    = _lat_open,
+	.read    = seq_read,
+	.write   = _lat_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+int rt_vbus_stats_init(void *bulk)
+{
+	rt_vbus_stats = alloc_percpu(struct rt_vbus_stats);
+	if (!rt_vbus_stats)
+		return -ENOMEM;
+	rt_vbus_lat = alloc_percpu(struct rt_vbus_lat_hist);
+	if (!rt_vbus_lat) {
+		free_percpu(rt_vbus_stats);
+		rt_vbus_stats = NULL;
+		return -ENOMEM;
+	}
+
+	/* Without the global timer RT-Thread gets no stamps. */
+	rt_vbus_lat_gt = ioremap(RT_VBUS_GTIMER_BASE, 4);
+	if (!rt_vbus_lat_gt)
+		pr_info("VMM/Bus: no global timer for the post stamps\n");
+	rt_vbus_lat_tbl = (u32 *)((char *)bulk + _RT_VBUS_BULK_SZ / 2
+				  - _RT_VBUS_LAT_TBL_SZ);
+	memset(rt_vbus_lat_tbl, 0, _RT_VBUS_LAT_TBL_SZ);
+
+	/* The counters still work without debugfs. */
+	_stats_dir = debugfs_create_dir("rtvbus", NULL);
+	if (IS_ERR_OR_NULL(_stats_dir)) {
+		pr_info("VMM/Bus: no debugfs for the statistics\n");
+		_stats_dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", 0600, _stats_dir, NULL, &_stats_fops);
+	debugfs_create_file("latency", 0600, _stats_dir, NULL, &_lat_fops);
+
+	return 0;
+}
+
+void rt_vbus_stats_deinit(void)
+{
+	debugfs_remove_recursive(_stats_dir);
+	_stats_dir = NULL;
+	rt_vbus_lat_tbl = NULL;
+	if (rt_vbus_lat_gt)
+		iounmap(rt_vbus_lat_gt);
+	rt_vbus_lat_gt = NULL;
+	free_percpu(rt_vbus_lat);
+	rt_vbus_lat = NULL;
+	free_percpu(rt_vbus_stats);
+	rt_vbus_stats = NULL;
+}
+
+#endif
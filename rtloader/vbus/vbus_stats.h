@@ -0,0 +1,207 @@
+/*
+ *  VMM Bus statistics
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#ifndef __VBUS_STATS_H__
+#define __VBUS_STATS_H__
+
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/io.h>
+
+#include <vbus_api.h>
+#include <vbus_layout.h>
+
+#include "linux_driver.h"
+
+enum rt_vbus_stat_item {
+	RT_VBUS_STAT_RX_PKTS,
+	RT_VBUS_STAT_RX_BYTES,
+	RT_VBUS_STAT_TX_PKTS,
+	RT_VBUS_STAT_TX_BYTES,
+	/* Packets dropped on the receive side. */
+	RT_VBUS_STAT_DROP_NOMEM,
+	RT_VBUS_STAT_DROP_INVALID,
+	RT_VBUS_STAT_DROP_CLOSED,
+	RT_VBUS_STAT_DROP_RXMAP,
+	/* Times the drain stopped for no receive buffer. */
+	RT_VBUS_STAT_RX_STALLS,
+	/* Packets taken ahead of the backlog by their priority. */
+	RT_VBUS_STAT_RX_URGENT,
+	RT_VBUS_STAT_SUSPEND_TX,
+	RT_VBUS_STAT_SUSPEND_RX,
+	RT_VBUS_STAT_RESUME_TX,
+	RT_VBUS_STAT_RESUME_RX,
+	/* Time blocked on the post water mark, in ns. */
+	RT_VBUS_STAT_WM_WAIT_NS,
+	/* Waits for space in the IN_RING and the time spent, in ns. */
+	RT_VBUS_STAT_RING_WAITS,
+	RT_VBUS_STAT_RING_WAIT_NS,
+	/* The IPIs are not per channel. They are accounted to chn0. */
+	RT_VBUS_STAT_IPI_TX,
+	RT_VBUS_STAT_IPI_RX,
+	RT_VBUS_STAT_NR,
+};
+
+struct rt_vbus_stats {
+	u64 cnt[RT_VBUS_CHANNEL_NR][RT_VBUS_STAT_NR];
+};
+
+/* Hops of a message timed by the latency histograms. */
+enum rt_vbus_lat_stage {
+	/* rt_vbus_post entry to the commit into the IN_RING. */
+	RT_VBUS_LAT_POST_COMMIT,
+	/* IPI from the other side to the drain of the OUT_RING. Not per
+	 * channel, accounted to chn0. */
+	RT_VBUS_LAT_IPI_DRAIN,
+	/* Drain of the OUT_RING to the delivery by read(2). */
+	RT_VBUS_LAT_DRAIN_READ,
+	RT_VBUS_LAT_NR,
+};
+
+/* Bucket i counts the latencies in [2^i, 2^(i+1)) ns. */
+#define RT_VBUS_LAT_BUCKETS 32
+
+struct rt_vbus_lat_hist {
+	u32 cnt[RT_VBUS_CHANNEL_NR][RT_VBUS_LAT_NR][RT_VBUS_LAT_BUCKETS];
+};
+
+#ifdef RT_VBUS_USING_STATS
+extern struct rt_vbus_stats __percpu *rt_vbus_stats;
+
+/** Count on the local CPU.
+ *
+ * It is safe in any context and takes no lock. The CPUs are summed up when
+ * the debugfs file is read.
+ */
+static inline void rt_vbus_stat_add(unsigned int chnr,
+				    enum rt_vbus_stat_item item, u64 val)
+{
+	this_cpu_add(rt_vbus_stats->cnt[chnr][item], val);
+}
+
+/* Timestamp for the *_NS counters. */
+static inline u64 rt_vbus_stat_clock(void)
+{
+	return local_clock();
+}
+
+extern struct rt_vbus_lat_hist __percpu *rt_vbus_lat;
+extern bool rt_vbus_lat_on;
+
+/** Timestamp a message for the latency histograms.
+ *
+ * Return 0 if they are off. The stamps may be taken and accounted on
+ * different CPUs so the clocksource is used instead of local_clock.
+ */
+static inline u64 rt_vbus_lat_stamp(void)
+{
+	return ACCESS_ONCE(rt_vbus_lat_on) ? ktime_get_ns() : 0;
+}
+
+extern u32 *rt_vbus_lat_tbl;
+extern void __iomem *rt_vbus_lat_gt;
+
+/** Stamp a message for the post->dequeue histograms of RT-Thread.
+ *
+ * It is the low word of the global timer, never 0 so 0 means no stamp.
+ * Return 0 if the histograms are off.
+ */
+static inline u32 rt_vbus_lat_gstamp(void)
+{
+	if (!ACCESS_ONCE(rt_vbus_lat_on) || !rt_vbus_lat_gt)
+		return 0;
+	return readl_relaxed(rt_vbus_lat_gt) | 1;
+}
+
+/* Stamp the blocks [start, end) of the IN_RING of the queue q before they
+ * are committed. RT-Thread finds the stamp by the first block of a packet.
+ * Only queue 0 has a table, RT-Thread does not drain the others in its ISR. */
+static inline void rt_vbus_lat_put_stamp(unsigned int q, unsigned int start,
+					 unsigned int end, unsigned int blk_nr,
+					 u32 gts)
+{
+	u32 *tbl;
+
+	if (!gts || !rt_vbus_lat_tbl || q != 0)
+		return;
+
+	tbl = rt_vbus_lat_tbl;
+	for (; start != end; start = (start + 1) % blk_nr)
+		tbl[start] = gts;
+}
+
+/* Account the time since the stamp to the stage of the channel. */
+static inline void rt_vbus_lat_account(unsigned int chnr,
+				       enum rt_vbus_lat_stage stage, u64 since)
+{
+	u64 d;
+	int b;
+
+	if (!since)
+		return;
+
+	d = ktime_get_ns() - since;
+	b = d ? fls64(d) - 1 : 0;
+	if (b >= RT_VBUS_LAT_BUCKETS)
+		b = RT_VBUS_LAT_BUCKETS - 1;
+	this_cpu_inc(rt_vbus_lat->cnt[chnr][stage][b]);
+}
+
+/** Create /sys/kernel/debug/rtvbus/stats and latency.
+ *
+ * Reading them dumps the non-zero counters or histograms of each channel.
+ * Writing anything to them clears them. The histograms are only filled when
+ * the lat_hist module parameter is set.
+ *
+ * bulk is the bulk region, which holds the post stamps for RT-Thread.
+ */
+int rt_vbus_stats_init(void *bulk);
+void rt_vbus_stats_deinit(void);
+#else
+static inline void rt_vbus_stat_add(unsigned int chnr,
+				    enum rt_vbus_stat_item item, u64 val) {}
+static inline u64 rt_vbus_stat_clock(void) { return 0; }
+static inline u64 rt_vbus_lat_stamp(void) { return 0; }
+static inline u32 rt_vbus_lat_gstamp(void) { return 0; }
+static inline void rt_vbus_lat_put_stamp(unsigned int q, unsigned int start,
+					 unsigned int end, unsigned int blk_nr,
+					 u32 gts) {}
+static inline void rt_vbus_lat_account(unsigned int chnr,
+				       enum rt_vbus_lat_stage stage,
+				       u64 since) {}
+static inline int rt_vbus_stats_init(void *bulk) { return 0; }
+static inline void rt_vbus_stats_deinit(void) {}
+#endif
+
+static inline void rt_vbus_stat_inc(unsigned int chnr,
+				    enum rt_vbus_stat_item item)
+{
+	rt_vbus_stat_add(chnr, item, 1);
+}
+
+#endif /* end of include guard: __VBUS_STATS_H__ */
@@ -0,0 +1,137 @@
+/*
+ *  VMM Bus tracepoints
+ *
+ * COPYRIGHT (C) 2026, Shanghai Real-Thread Technology Co., Ltd
+ *
+ *  This file is part of RT-Thread (http://www.rt-thread.org)
+ *
+ *  All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Change Logs:
+ * Date           Author       Notes
+ * 2026-10-18     RealThread   first version
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vbus
+
+#if !defined(__VBUS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __VBUS_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+/* Message handed to rt_vbus_post, before any blocking. */
+TRACE_EVENT(vbus_post,
+	TP_PROTO(unsigned char id, unsigned char prio, size_t len),
+	TP_ARGS(id, prio, len),
+	TP_STRUCT__entry(
+		__field(unsigned char, id)
+		__field(unsigned char, prio)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->id   = id;
+		__entry->prio = prio;
+		__entry->len  = len;
+	),
+	TP_printk("chn=%u prio=%u len=%zu",
+		  __entry->id, __entry->prio, __entry->len)
+);
+
+/* Packet committed into the IN_RING, directly by the poster or by the
+ * worker. */
+TRACE_EVENT(vbus_do_post,
+	TP_PROTO(unsigned char id, unsigned char prio, size_t len, int direct),
+	TP_ARGS(id, prio, len, direct),
+	TP_STRUCT__entry(
+		__field(unsigned char, id)
+		__field(unsigned char, prio)
+		__field(size_t, len)
+		__field(int, direct)
+	),
+	TP_fast_assign(
+		__entry->id     = id;
+		__entry->prio   = prio;
+		__entry->len    = len;
+		__entry->direct = direct;
+	),
+	TP_printk("chn=%u prio=%u len=%zu%s",
+		  __entry->id, __entry->prio, __entry->len,
+		  __entry->direct ? " direct" : "")
+);
+
+/* Packet taken off the OUT_RING. */
+TRACE_EVENT(vbus_recv,
+	TP_PROTO(unsigned int id, size_t len),
+	TP_ARGS(id, len),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->id  = id;
+		__entry->len = len;
+	),
+	TP_printk("chn=%u len=%zu", __entry->id, __entry->len)
+);
+
+/* Command received on chn0. */
+TRACE_EVENT(vbus_chn0_cmd,
+	TP_PROTO(unsigned char cmd, unsigned char arg, size_t len),
+	TP_ARGS(cmd, arg, len),
+	TP_STRUCT__entry(
+		__field(unsigned char, cmd)
+		__field(unsigned char, arg)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+		__entry->len = len;
+	),
+	TP_printk("cmd=%#x arg=%u len=%zu",
+		  __entry->cmd, __entry->arg, __entry->len)
+);
+
+/* SUSPEND or RESUME of a channel. remote is 1 if the other side asked us
+ * to stop or restart posting, 0 if we asked the other side. */
+TRACE_EVENT(vbus_flow,
+	TP_PROTO(unsigned char id, int suspend, int remote),
+	TP_ARGS(id, suspend, remote),
+	TP_STRUCT__entry(
+		__field(unsigned char, id)
+		__field(int, suspend)
+		__field(int, remote)
+	),
+	TP_fast_assign(
+		__entry->id      = id;
+		__entry->suspend = suspend;
+		__entry->remote  = remote;
+	),
+	TP_printk("chn=%u %s %s", __entry->id,
+		  __entry->suspend ? "suspend" : "resume",
+		  __entry->remote ? "<-- remote" : "--> remote")
+);
+
+#endif /* __VBUS_TRACE_H__ */
+
+/* Out of the kernel tree, the header is found by -I$(src)/vbus. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vbus_trace
+#include <trace/define_trace.h>
@@ -91,6 +91,27 @@ static inline int rt_wm_que_inc(struct rt_watermark_queue *wg)
 	return 0;
 }
 
+/** Increase the water level if it is not above the high mark.
+ *
+ * Return -EAGAIN instead of suspending the thread.
+ */
+static inline int rt_wm_que_tryinc(struct rt_watermark_queue *wg)
+{
+	spin_lock(&wg->lock);
+
+	if (wg->level > wg->high_mark) {
+		spin_unlock(&wg->lock);
+		return -EAGAIN;
+	}
+
+	wg->level++;
+	if (wg->level == 0)
+		wg->level = -1;
+	spin_unlock(&wg->lock);
+
+	return 0;
+}
+
 /** Decrease the water level.
  *
  * It should be called by the consumer that drain the water out. If the water
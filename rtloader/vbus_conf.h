@@ -37,8 +37,22 @@
 #define RT_VBUS_OUT_RING   ((struct rt_vbus_ring*)(_RT_VBUS_RING_BASE))
 #define RT_VBUS_IN_RING    ((struct rt_vbus_ring*)(_RT_VBUS_RING_BASE + _RT_VBUS_RING_SZ))
 
+/* Number of ring pairs. Queue 0 is the pair above, queue q is the OUT_RING
+ * and the IN_RING right below queue q-1. Each queue has its own IPIs so at
+ * most 4 queues fit in the spare IPIs of Linux. */
+#define RT_VBUS_QUEUE_NR   2
+#define _RT_VBUS_QUEUE_BASE(q) (_RT_VBUS_RING_BASE - (q) * 2 * _RT_VBUS_RING_SZ)
+
+/* Buffers of the bulk transfer, right below the rings. The extra queues take
+ * their rings from it. */
+#define _RT_VBUS_BULK_SZ   (8 * 1024 * 1024 - (RT_VBUS_QUEUE_NR - 1) * 2 * _RT_VBUS_RING_SZ)
+#define _RT_VBUS_BULK_BASE (_RT_VBUS_QUEUE_BASE(RT_VBUS_QUEUE_NR - 1) - _RT_VBUS_BULK_SZ)
+
 #define RT_VBUS_GUEST_VIRQ   14
 #define RT_VBUS_HOST_VIRQ    15
+/* IPIs of the queue q. */
+#define RT_VBUS_GUEST_VIRQ_Q(q) (RT_VBUS_GUEST_VIRQ - 2 * (q))
+#define RT_VBUS_HOST_VIRQ_Q(q)  (RT_VBUS_HOST_VIRQ - 2 * (q))
 
 #define RT_VBUS_SHELL_DEV_NAME "vbser0"
 #define RT_VBUS_RFS_DEV_NAME   "rfs"
@@ -50,4 +64,13 @@
  * RT_VMM_RB_BLK_NR * 64byte * 2. */
 #define RT_VMM_RB_BLK_NR     (_RT_VBUS_RING_SZ / 64 - 1) 
 
+/* The post stamps for the latency histograms of RT-Thread, at the top of the
+ * lower half of the bulk region. One word per block of the IN_RING of queue
+ * 0, the only one RT-Thread takes interrupts for, in ticks of the Cortex-A9
+ * global timer which both sides can read. */
+#define _RT_VBUS_LAT_TBL_SZ   ((RT_VMM_RB_BLK_NR + 1) * 4)
+#define _RT_VBUS_LAT_TBL_BASE (_RT_VBUS_BULK_BASE + _RT_VBUS_BULK_SZ / 2 \
+			       - _RT_VBUS_LAT_TBL_SZ)
+#define RT_VBUS_GTIMER_BASE   0x1E000200
+
 #endif
@@ -31,4 +31,169 @@
 
 #include "vbus_conf.h"
 
+/* Extension commands on chn0. They are out of the range of the original
+ * commands so a peer that does not know them just ignores them. */
+
+/* Negotiate the optional features: {FEATURE, bits}. The peer answers with
+ * {ACK, FEATURE, bits} carrying the bits both sides support. */
+#define RT_VBUS_CHN0_CMD_FEATURE    0x80
+
+/* Switch the rings to a new layout: {LAYOUT, version}. See the comment of
+ * struct rt_vbus_ring_v2. */
+#define RT_VBUS_CHN0_CMD_LAYOUT     0x81
+
+/* Lend a bulk buffer to the other side, see struct rt_vbus_bulk_desc. */
+#define RT_VBUS_CHN0_CMD_BULK       0x82
+/* Give the bulk buffer back, with the same descriptor. */
+#define RT_VBUS_CHN0_CMD_BULK_DONE  0x83
+
+/* Move a channel to another ring pair: {QUEUE, chnr, queue}. Sent by Linux
+ * before the channel is established so both sides post on the same queue. A
+ * disabled channel is back on queue 0. */
+#define RT_VBUS_CHN0_CMD_QUEUE      0x84
+
+/* Feature bits. */
+/* The event index in struct rt_vbus_ring_evt is honored. */
+#define RT_VBUS_F_EVENT_IDX         (1 << 0)
+/* The BULK commands are understood. */
+#define RT_VBUS_F_BULK              (1 << 1)
+/* The RT_VBUS_QUEUE_NR ring pairs are used. The rings of the queues other
+ * than 0 are formatted by Linux in the layout of queue 0 before it asks for
+ * the feature. chn0 always stays on queue 0. */
+#define RT_VBUS_F_MQ                (1 << 2)
+/* The fragments of a message but the last one are marked by
+ * RT_VBUS_BLK_F_MORE in blk.reserved, or RT_VBUS_REC_F_MORE in rec.flags of
+ * the V3 ring. */
+#define RT_VBUS_F_FRAG              (1 << 3)
+
+#define RT_VBUS_BLK_F_MORE          (1 << 0)
+
+/* Descriptor of a bulk buffer.
+ *
+ * The data of a big message is put in a buffer in the bulk region
+ * (_RT_VBUS_BULK_BASE) and only the descriptor goes through the ring on chn0.
+ * Linux allocates the buffers from the lower half of the region and RT-Thread
+ * from the upper half. The receiver owns the buffer until it sends the
+ * descriptor back by BULK_DONE.
+ */
+struct rt_vbus_bulk_desc {
+	unsigned char cmd;
+	unsigned char chnr;
+	unsigned char reserved[2];
+	/* Offset from the start of the bulk region. */
+	unsigned int off;
+	unsigned int len;
+};
+
+/* Event index of a ring. It lives in the spare space after the last block of
+ * the ring area.
+ *
+ * The producer only notifies the consumer when put_idx moves past put_event.
+ * The blocked producer sets get_event and the consumer only notifies it when
+ * get_idx moves past get_event. Both are only used after RT_VBUS_F_EVENT_IDX
+ * is negotiated.
+ */
+struct rt_vbus_ring_evt {
+	/* Written by the consumer. */
+	volatile unsigned int put_event;
+	/* Written by the producer. */
+	volatile unsigned int get_event;
+};
+
+#define RT_VBUS_RING_EVT(ring) \
+	((struct rt_vbus_ring_evt*)((char*)(ring) + _RT_VBUS_RING_SZ \
+				    - sizeof(struct rt_vbus_ring_evt)))
+
+/* Whether the index moving from old to new has passed event. nr is the
+ * number of blocks in the ring. */
+static inline int rt_vbus_need_event(unsigned int event,
+				     unsigned int new, unsigned int old,
+				     unsigned int nr)
+{
+	unsigned int devt = (event + nr - old) % nr;
+	unsigned int dnew = (new + nr - old) % nr;
+
+	return devt < dnew;
+}
+
+/* Ring layout versions. */
+/* struct rt_vbus_ring in vbus_api.h */
+#define RT_VBUS_LAYOUT_V1           1
+/* struct rt_vbus_ring_v2 */
+#define RT_VBUS_LAYOUT_V2           2
+/* struct rt_vbus_ring_v3 */
+#define RT_VBUS_LAYOUT_V3           3
+
+#define RT_VBUS_LAYOUT_MAGIC        0x56425300
+#define RT_VBUS_CACHE_LINE_SZ       64
+
+#define RT_VBUS_V2_BLK_NR           (_RT_VBUS_RING_SZ / 64 - 2)
+
+/* Ring with the fields written by the producer and the consumer on separate
+ * cache lines, so they don't bounce between the cores on every update.
+ *
+ * The rings start in V1. Linux proposes V2 by {LAYOUT, 2} as the last packet
+ * it puts on the IN_RING and stops posting. Once RT-Thread consumed it, it
+ * formats the IN_RING in V2, sets cons.layout to RT_VBUS_LAYOUT_MAGIC | 2,
+ * puts {ACK, LAYOUT, 2} as its last packet on the OUT_RING and stops
+ * posting. Linux formats the OUT_RING the same way once it consumed the ACK.
+ * Each side waits for the magic in the ring it produces before posting
+ * again. A NAK or no answer keeps V1.
+ */
+struct rt_vbus_ring_v2 {
+	struct {
+		volatile size_t put_idx;
+		volatile unsigned int get_event;
+		volatile unsigned int blocked;
+	} prod __attribute__((aligned(RT_VBUS_CACHE_LINE_SZ)));
+	struct {
+		volatile size_t get_idx;
+		volatile unsigned int put_event;
+		volatile unsigned int layout;
+	} cons __attribute__((aligned(RT_VBUS_CACHE_LINE_SZ)));
+	struct rt_vbus_blk blks[RT_VBUS_V2_BLK_NR];
+};
+
+/* Head of a record in the V3 ring. */
+struct rt_vbus_rec {
+	unsigned char id;
+	unsigned char qos;
+	unsigned short flags;
+	/* Bytes of the payload following the head. */
+	unsigned int len;
+};
+
+/* The record only fills the space and should be skipped. */
+#define RT_VBUS_REC_F_PAD           (1 << 0)
+/* More fragments of the message follow, see RT_VBUS_F_FRAG. */
+#define RT_VBUS_REC_F_MORE          (1 << 1)
+
+#define RT_VBUS_REC_SZ              sizeof(struct rt_vbus_rec)
+#define RT_VBUS_V3_UNIT_NR          ((_RT_VBUS_RING_SZ - 2 * RT_VBUS_CACHE_LINE_SZ) \
+				     / RT_VBUS_REC_SZ)
+/* A record is at most one page. */
+#define RT_VBUS_V3_MAX_PKT_SZ       (4096 - RT_VBUS_REC_SZ)
+
+/* Byte ring with length-prefixed records. The header is the same as V2 but
+ * put_idx and get_idx count 8-byte units instead of blocks.
+ *
+ * A record is a struct rt_vbus_rec followed by len bytes of payload, padded
+ * to 8 bytes. It never wraps around the end of the ring: if it does not fit
+ * in the tail, the producer fills the tail with a PAD record and puts it at
+ * the start. It is negotiated by {LAYOUT, 3} the same way as V2.
+ */
+struct rt_vbus_ring_v3 {
+	struct {
+		volatile size_t put_idx;
+		volatile unsigned int get_event;
+		volatile unsigned int blocked;
+	} prod __attribute__((aligned(RT_VBUS_CACHE_LINE_SZ)));
+	struct {
+		volatile size_t get_idx;
+		volatile unsigned int put_event;
+		volatile unsigned int layout;
+	} cons __attribute__((aligned(RT_VBUS_CACHE_LINE_SZ)));
+	struct rt_vbus_rec recs[RT_VBUS_V3_UNIT_NR];
+};
+
 #endif /* end of include guard: __VBUS_LAYOUT_H__ */
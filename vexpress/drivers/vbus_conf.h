@@ -6,13 +6,34 @@
 #define _RT_VBUS_RING_BASE (0x6f800000)
 #define _RT_VBUS_RING_SZ   (2 * 1024 * 1024)
 
+/* Number of ring pairs, keep it the same as the Linux side. Queue q is right
+ * below queue q-1. */
+#define RT_VBUS_QUEUE_NR      2
+#define _RT_VBUS_QUEUE_BASE(q) (_RT_VBUS_RING_BASE - (q) * 2 * _RT_VBUS_RING_SZ)
+
 /* Number of blocks in VBus. The total size of VBus is
  * RT_VMM_RB_BLK_NR * 64byte * 2. */
 #define RT_VMM_RB_BLK_NR     (_RT_VBUS_RING_SZ / 64 - 1)
 
+/* Buffers of the bulk transfer, right below the rings. Keep it the same as
+ * the Linux side. */
+#define _RT_VBUS_BULK_SZ   (8 * 1024 * 1024 - (RT_VBUS_QUEUE_NR - 1) * 2 * _RT_VBUS_RING_SZ)
+#define _RT_VBUS_BULK_BASE (_RT_VBUS_QUEUE_BASE(RT_VBUS_QUEUE_NR - 1) - _RT_VBUS_BULK_SZ)
+
+/* The post stamps Linux puts for the latency histograms, at the top of the
+ * lower half of the bulk region. One word per block of the ring from Linux
+ * of queue 0, in ticks of the Cortex-A9 global timer. */
+#define _RT_VBUS_LAT_TBL_SZ   ((RT_VMM_RB_BLK_NR + 1) * 4)
+#define _RT_VBUS_LAT_TBL_BASE (_RT_VBUS_BULK_BASE + _RT_VBUS_BULK_SZ / 2 \
+                               - _RT_VBUS_LAT_TBL_SZ)
+#define RT_VBUS_GTIMER_BASE   0x1E000200
+
 /* We don't use the IRQ number to trigger IRQ in this BSP. */
 #define RT_VBUS_GUEST_VIRQ    14
 #define RT_VBUS_HOST_VIRQ     15
+/* IPIs of the queue q. */
+#define RT_VBUS_GUEST_VIRQ_Q(q) (RT_VBUS_GUEST_VIRQ - 2 * (q))
+#define RT_VBUS_HOST_VIRQ_Q(q)  (RT_VBUS_HOST_VIRQ - 2 * (q))
 
 #define RT_VBUS_SHELL_DEV_NAME "vbser0"
 #define RT_VBUS_RFS_DEV_NAME   "rfs"
@@ -35,6 +35,7 @@
 #include <interrupt.h>
 #include <vbus.h>
 #include <board.h>
+#include "vbus_local_conf.h"
 
 int rt_vbus_do_init(void)
 {
@@ -43,13 +44,144 @@ int rt_vbus_do_init(void)
 }
 INIT_COMPONENT_EXPORT(rt_vbus_do_init);
 
+#ifdef RT_VBUS_USING_LAT_HIST
+/* Per channel log2 histograms of the time from rt_vbus_post on Linux to the
+ * dequeue by rt_vbus_isr, in ticks of the global timer which both sides can
+ * read. Linux stamps the blocks it puts into the ring with the post time, see
+ * _RT_VBUS_LAT_TBL_BASE. Bucket i counts [2^i, 2^(i+1)) ticks.
+ *
+ * Only queue 0 in the V1 ring layout is looked at, Linux does not stamp the
+ * other queues. */
+#define VBUS_LAT_BUCKETS 32
+/* Packets looked at per rt_vbus_isr, the rest are not counted. The ring is
+ * uncached so keep the walk short. */
+#define VBUS_LAT_PKTS    16
+
+#define _GT_COUNTER      (*(volatile rt_uint32_t *)(RT_VBUS_GTIMER_BASE + 0x00))
+#define _GT_CONTROL      (*(volatile rt_uint32_t *)(RT_VBUS_GTIMER_BASE + 0x08))
+
+#define _LAT_RING        ((struct rt_vbus_ring *)(_RT_VBUS_RING_BASE + _RT_VBUS_RING_SZ))
+#define _LAT_TBL         ((volatile rt_uint32_t *)_RT_VBUS_LAT_TBL_BASE)
+#define _LAT_BNR(len)    (((len) + RT_VBUS_BLK_HEAD_SZ + sizeof(struct rt_vbus_blk) - 1) \
+                          / sizeof(struct rt_vbus_blk))
+
+static rt_uint32_t _lat_hist[RT_VBUS_CHANNEL_NR][VBUS_LAT_BUCKETS];
+
+struct _lat_pkt
+{
+    rt_uint32_t idx;
+    rt_uint32_t stamp;
+    rt_uint8_t  chnr;
+};
+
+/* The snapshot of the running rt_vbus_isr. Not on the stack, the IRQ stack
+ * is small. */
+static struct _lat_pkt _lat_pkts[VBUS_LAT_PKTS];
+
+static void _lat_account(int chnr, rt_uint32_t ticks)
+{
+    int b = 0;
+
+    while (ticks >>= 1)
+        b++;
+    _lat_hist[chnr][b]++;
+}
+
+/* Take the packets committed so far. Their blocks are given back to Linux
+ * once rt_vbus_isr consumed them, so read the stamps before that. */
+static int _lat_snapshot(struct _lat_pkt *pkts, rt_uint32_t get)
+{
+    struct rt_vbus_ring *rg = _LAT_RING;
+    rt_uint32_t idx = get, put = rg->put_idx;
+    int nr = 0;
+
+    /* Read the stamps after the put_idx. */
+    __asm__ volatile ("dmb" ::: "memory");
+    while (idx != put && nr < VBUS_LAT_PKTS)
+    {
+        pkts[nr].idx   = idx;
+        pkts[nr].chnr  = rg->blks[idx].id;
+        pkts[nr].stamp = _LAT_TBL[idx];
+        nr++;
+        idx = (idx + _LAT_BNR(rg->blks[idx].len)) % RT_VMM_RB_BLK_NR;
+    }
+    return nr;
+}
+
+/* Account the packets of the snapshot that are dequeued since get. */
+static void _lat_dequeued(struct _lat_pkt *pkts, int nr, rt_uint32_t get)
+{
+    rt_uint32_t now = _GT_COUNTER;
+    rt_uint32_t done = (_LAT_RING->get_idx + RT_VMM_RB_BLK_NR - get)
+                       % RT_VMM_RB_BLK_NR;
+    int i;
+
+    for (i = 0; i < nr; i++)
+    {
+        if ((pkts[i].idx + RT_VMM_RB_BLK_NR - get) % RT_VMM_RB_BLK_NR >= done)
+            break;
+        /* No stamp if Linux does not take the histograms. */
+        if (pkts[i].stamp && pkts[i].chnr < RT_VBUS_CHANNEL_NR)
+            /* The timer wraps, the unsigned subtraction is fine. */
+            _lat_account(pkts[i].chnr, now - pkts[i].stamp);
+    }
+}
+
+int vbus_lat(int argc, char **argv)
+{
+    int chnr, i;
+
+    if (argc > 1 && rt_strcmp(argv[1], "clear") == 0)
+    {
+        rt_memset(_lat_hist, 0, sizeof(_lat_hist));
+        return 0;
+    }
+
+    rt_kprintf("rt_vbus_post on Linux to rt_vbus_isr, in global timer ticks\n");
+    rt_kprintf("(queue 0 only, first %d packets per interrupt):\n", VBUS_LAT_PKTS);
+    for (chnr = 0; chnr < RT_VBUS_CHANNEL_NR; chnr++)
+    {
+        int used = 0;
+
+        for (i = 0; i < VBUS_LAT_BUCKETS; i++)
+        {
+            if (!_lat_hist[chnr][i])
+                continue;
+            if (!used)
+                rt_kprintf("chn %d:\n", chnr);
+            used = 1;
+            rt_kprintf("%10u - %10u: %u\n",
+                       i ? (rt_uint32_t)1 << i : 0,
+                       ((rt_uint32_t)2 << i) - 1, _lat_hist[chnr][i]);
+        }
+    }
+    return 0;
+}
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+FINSH_FUNCTION_EXPORT_ALIAS(vbus_lat, __cmd_vbus_lat, show vbus latency histograms of queue 0);
+#endif
+#endif
+
 static void _bus_resume_in_thread(int irqnr, void *param)
 {
+#ifdef RT_VBUS_USING_LAT_HIST
+    rt_uint32_t get = _LAT_RING->get_idx;
+    int nr = _lat_snapshot(_lat_pkts, get);
+
+    rt_vbus_isr(irqnr, RT_NULL);
+    _lat_dequeued(_lat_pkts, nr, get);
+#else
     rt_vbus_isr(irqnr, RT_NULL);
+#endif
 }
 
 int rt_vbus_hw_init(void)
 {
+#ifdef RT_VBUS_USING_LAT_HIST
+    /* Linux reads it too but does not start it. */
+    _GT_CONTROL |= 0x01;
+#endif
     rt_kprintf("install irq: %d\n", RT_VBUS_HOST_VIRQ);
     rt_hw_interrupt_install(RT_VBUS_HOST_VIRQ,
                             _bus_resume_in_thread, RT_NULL,
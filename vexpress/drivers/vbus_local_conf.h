@@ -5,4 +5,8 @@
 
 #define RT_VBUS_USING_TESTS
 
+/* Time the messages from rt_vbus_post on Linux to the dequeue here, see the
+ * vbus_lat command. It adds a walk of the ring to every vbus interrupt. */
+/* #define RT_VBUS_USING_LAT_HIST */
+
 #endif /* end of include guard: __VBUS_LOCAL_CONF_H__ */